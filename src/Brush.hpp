@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <unordered_set>
 
 #include "Initial3D.hpp"
 #include "Graph.hpp"
@@ -36,27 +37,11 @@ namespace skadi {
 		virtual void onDeactivate(const initial3d::vec3f &position, float radius, Graph *g) {  }
 
 		std::vector<Graph::Node *> getNodesInBrush(const initial3d::vec3f &position, float radius, Graph *g) {
-			std::vector<Graph::Node *> nodes;
-			for (Graph::Node * n : g->getNodes()) {
-				if ((n->position - position).mag() <= radius ) {
-					nodes.push_back(n);
-				}
-			}
-			return nodes;
+			return g->findNodes(position, radius);
 		}
 
 		Graph::Node * getClosestNodeInBrush(const initial3d::vec3f &position, float radius, Graph *g, Graph::Node *exclude = nullptr) {
-			Graph::Node *n = nullptr;
-			float distance = radius; // NOT RANDOM
-			for (Graph::Node *node : g->getNodes()) {
-				if (node == exclude) continue;
-				float newDis = (node->position - position).mag();
-				if (newDis < distance) {
-					n = node;
-					distance = newDis;
-				}
-			}
-			return n;
+			return g->findClosestNode(position, radius, exclude);
 		}
 
 	private:
@@ -78,12 +63,8 @@ namespace skadi {
 		}
 
 		virtual void step(const initial3d::vec3f &position, float radius, const initial3d::vec3f &travel_distance, Graph *g) override {
-			std::vector<Graph::Node *> nodes;
-			for (Graph::Node * n : g->getNodes()) {
-				if ((n->position - position).mag() <= radius ) {
-					nodes.push_back(n);
-					std::cout << "Node :: " << n->position << std::endl;
-				}
+			for (Graph::Node * n : getNodesInBrush(position, radius, g)) {
+				std::cout << "Node :: " << n->position << std::endl;
 			}
 			std::cout << "CLICK STEP Alt=" << isAlt() << " : " << position << std::endl;
 		}
@@ -111,23 +92,26 @@ namespace skadi {
 				n++;
 			}
 			e /= n;
-			temp_node = g->addNode(position, e);
-			temp_node->fixed = true;
+			Graph::Node *node = g->addNode(position, e);
+			g->setFixed(node, true);
+			temp_node = g->handle(node);
 		}
 
 		virtual void onDeactivate(const initial3d::vec3f &position, float radius, Graph *g) override {
 			std::cout << position << std::endl;
-			Graph::Node *n = getClosestNodeInBrush(position, radius, g, temp_node);
-			if (n != nullptr) {
-				g->addEdge(temp_node, n);
-				temp_node->fixed = false;
+			// temp node may have been deleted mid-stroke
+			Graph::Node *node = g->resolve(temp_node);
+			Graph::Node *n = getClosestNodeInBrush(position, radius, g, node);
+			if (n != nullptr && node != nullptr) {
+				g->addEdge(node, n);
+				g->setFixed(node, false);
 			}
-			temp_node = nullptr;
+			temp_node = Graph::NodeHandle();
 		}
 
 	private:
 		NodeBrush() {}
-		Graph::Node *temp_node = nullptr;
+		Graph::NodeHandle temp_node;
 	};
 
 
@@ -167,7 +151,7 @@ namespace skadi {
 
 		virtual void step(const initial3d::vec3f &position, float radius, const initial3d::vec3f &travel_distance, Graph *g) override {
 			for (Graph::Node * n : getNodesInBrush(position, radius, g)) {
-				n->fixed = !isAlt();
+				g->setFixed(n, !isAlt());
 			}
 		};
 
@@ -188,7 +172,10 @@ namespace skadi {
 		}
 
 		virtual void onActivate(const initial3d::vec3f &position, float radius, Graph *g) override {
-			temp_nodes = getNodesInBrush(position, radius, g);
+			temp_nodes.clear();
+			for (Graph::Node *n : getNodesInBrush(position, radius, g)) {
+				temp_nodes.push_back(g->handle(n));
+			}
 		}
 
 		virtual void onDeactivate(const initial3d::vec3f &position, float radius, Graph *g) override {
@@ -196,14 +183,17 @@ namespace skadi {
 		}
 
 		virtual void step(const initial3d::vec3f &position, float radius, const initial3d::vec3f &travel_distance, Graph *g) override {
-			for (Graph::Node * n : temp_nodes) {
-				n->position += travel_distance;
+			for (const Graph::NodeHandle &h : temp_nodes) {
+				// skip nodes deleted mid-stroke
+				Graph::Node *n = g->resolve(h);
+				if (!n) continue;
+				g->moveNode(n, travel_distance);
 			}
 		};
 
 	private:
 		MoveBrush() { }
-		std::vector<Graph::Node *> temp_nodes;
+		std::vector<Graph::NodeHandle> temp_nodes;
 	};
 
 	// elevation
@@ -228,7 +218,7 @@ namespace skadi {
 			auto nodes0 = getNodesInBrush(position, radius, g);
 			for (Graph::Node *n : nodes0) {
 				if (temp_nodes.find(n) != temp_nodes.end()) continue;
-				n->elevation += isAlt() ? -delta : delta;
+				g->setElevation(n, n->elevation + (isAlt() ? -delta : delta));
 			}
 			temp_nodes.clear();
 			temp_nodes.insert(nodes0.begin(), nodes0.end());
@@ -255,7 +245,10 @@ namespace skadi {
 		}
 
 		virtual void onActivate(const initial3d::vec3f &position, float radius, Graph *g) override {
-			temp_nodes = getNodesInBrush(position, radius, g);
+			temp_nodes.clear();
+			for (Graph::Node *n : getNodesInBrush(position, radius, g)) {
+				temp_nodes.push_back(g->handle(n));
+			}
 		}
 
 		virtual void onDeactivate(const initial3d::vec3f &position, float radius, Graph *g) override {
@@ -264,7 +257,10 @@ namespace skadi {
 
 		virtual void step(const initial3d::vec3f &position, float radius, const initial3d::vec3f &travel_distance, Graph *g) override {
 			for (Graph::Node * n : getNodesInBrush(position, radius, g)) {
-				for (Graph::Node *n0 : temp_nodes) {
+				for (const Graph::NodeHandle &h : temp_nodes) {
+					// skip nodes deleted mid-stroke
+					Graph::Node *n0 = g->resolve(h);
+					if (!n0) continue;
 					// don't add reflexive edges; this breaks the heightmap conversion
 					if (n0 == n) continue;
 					if (isAlt()) {
@@ -279,7 +275,7 @@ namespace skadi {
 
 	private:
 		ConnectBrush() { }
-		std::vector<Graph::Node *> temp_nodes;
+		std::vector<Graph::NodeHandle> temp_nodes;
 	};
 
 	// make a line of nodes
@@ -295,28 +291,35 @@ namespace skadi {
 		}
 
 		virtual void onActivate(const initial3d::vec3f &position, float radius, Graph *g) override {
-			temp_node = getClosestNodeInBrush(position, radius, g);
-			if (!temp_node) {
-				temp_node = g->addNode(position, 0.f);
-				temp_node->fixed = true;
+			Graph::Node *n = getClosestNodeInBrush(position, radius, g);
+			if (!n) {
+				n = g->addNode(position, 0.f);
+				g->setFixed(n, true);
 			}
+			temp_node = g->handle(n);
 		}
 
 		virtual void onDeactivate(const initial3d::vec3f &position, float radius, Graph *g) override {
-			temp_node = nullptr;
+			temp_node = Graph::NodeHandle();
 		}
 
 		virtual void step(const initial3d::vec3f &position, float radius, const initial3d::vec3f &travel_distance, Graph *g) override {
-			if ((position - temp_node->position).mag() > radius) {
-				Graph::Node *old_node = temp_node;
-				temp_node = g->addNode(position, old_node->elevation);
-				g->addEdge(old_node, temp_node);
+			// start again if the last node was deleted mid-stroke
+			Graph::Node *old_node = g->resolve(temp_node);
+			if (!old_node) {
+				onActivate(position, radius, g);
+				return;
+			}
+			if ((position - old_node->position).mag() > radius) {
+				Graph::Node *n = g->addNode(position, old_node->elevation);
+				g->addEdge(old_node, n);
+				temp_node = g->handle(n);
 			}
 		};
 
 	private:
 		NodeLineBrush() { }
-		Graph::Node *temp_node;
+		Graph::NodeHandle temp_node;
 	};
 
 }
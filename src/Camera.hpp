@@ -85,6 +85,13 @@ namespace skadi {
 			return initial3d::mat4d::rotate(!rot) * initial3d::mat4d::translate(-m_pos); //TODO check / recently switched this
 		}
 
+		// for scripted paths: place the camera, turned rot_h about world up and looking rot_v above level
+		void setPose(const initial3d::vec3d &pos, double rot_h, double rot_v) {
+			m_pos = pos;
+			m_ori = initial3d::quatd::axisangle(initial3d::vec3d::j(), rot_h);
+			m_rot_v = rot_v;
+		}
+
 		void update() {
 
 			using namespace initial3d;
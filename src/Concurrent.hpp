@@ -364,6 +364,49 @@ namespace gecom {
 
 	};
 
+	// lock-free triple buffer for a single producer and a single consumer.
+	// the producer fills back() then calls publish(); the consumer calls update()
+	// to take the latest published buffer, then reads front().
+	// the producer gets an old buffer back after publishing, so must rewrite it completely.
+	template <typename T>
+	class triple_buffer : private Uncopyable {
+	private:
+		static const unsigned fresh_bit = 0x4;
+
+		T m_buffers[3];
+		// index of the buffer in transit between producer and consumer, plus fresh bit
+		std::atomic<unsigned> m_shared { 1 };
+		unsigned m_back = 0;
+		unsigned m_front = 2;
+
+	public:
+		inline triple_buffer() { }
+
+		// producer: buffer to write to
+		inline T & back() {
+			return m_buffers[m_back];
+		}
+
+		// producer: make the back buffer available to the consumer
+		inline void publish() {
+			m_back = m_shared.exchange(m_back | fresh_bit) & ~fresh_bit;
+		}
+
+		// consumer: take the latest published buffer, if any.
+		// returns true if front() changed.
+		inline bool update() {
+			if (!(m_shared.load() & fresh_bit)) return false;
+			m_front = m_shared.exchange(m_front) & ~fresh_bit;
+			return true;
+		}
+
+		// consumer: latest buffer taken by update()
+		inline T & front() {
+			return m_buffers[m_front];
+		}
+
+	};
+
 	// mechanism for asynchronous execution of arbitrary tasks
 	// yes i know std::async exists
 	class AsyncExecutor {
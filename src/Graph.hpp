@@ -3,13 +3,18 @@
 
 #include <algorithm>
 #include <cstdint>
-#include <unordered_set>
+#include <memory>
 #include <vector>
+#include <unordered_map>
 #include <random>
+#include <cmath>
+#include <new>
+#include <type_traits>
 
 
 #include "Initial3D.hpp"
 #include "Float3.hpp"
+#include "Pool.hpp"
 
 
 namespace skadi {
@@ -20,14 +25,100 @@ namespace skadi {
 		class Node;
 		class Edge;
 
+		// edges of a node, in the order they were added.
+		// stored inline up to a few edges (the common case), otherwise in an array from the graph's pools.
+		class EdgeList {
+		public:
+			static const unsigned inline_capacity = 4;
+
+			EdgeList() { }
+
+			EdgeList(const EdgeList &) = delete;
+			EdgeList & operator=(const EdgeList &) = delete;
+
+			Edge * const * begin() const {
+				return m_more ? m_more : m_inline;
+			}
+
+			Edge * const * end() const {
+				return begin() + m_size;
+			}
+
+			size_t size() const {
+				return m_size;
+			}
+
+			bool empty() const {
+				return m_size == 0;
+			}
+
+			Edge * operator[](size_t i) const {
+				return begin()[i];
+			}
+
+		private:
+			Edge *m_inline[inline_capacity];
+			Edge **m_more = nullptr;
+			unsigned m_size = 0;
+			unsigned m_capacity = inline_capacity;
+
+			Edge ** data() {
+				return m_more ? m_more : m_inline;
+			}
+
+			void push_back(Edge *e, Graph &g) {
+				if (m_size == m_capacity) {
+					// grow into a bigger array
+					Edge **more = g.allocEdgeArray(m_capacity * 2);
+					std::copy(data(), data() + m_size, more);
+					if (m_more) g.freeEdgeArray(m_more, m_capacity);
+					m_more = more;
+					m_capacity *= 2;
+				}
+				data()[m_size++] = e;
+			}
+
+			// keeps the order of remaining edges
+			bool erase(Edge *e, Graph &g) {
+				Edge **it = std::find(data(), data() + m_size, e);
+				if (it == data() + m_size) return false;
+				std::copy(it + 1, data() + m_size, it);
+				m_size--;
+				if (m_more && m_size <= inline_capacity) {
+					// back to inline storage
+					std::copy(m_more, m_more + m_size, m_inline);
+					g.freeEdgeArray(m_more, m_capacity);
+					m_more = nullptr;
+					m_capacity = inline_capacity;
+				}
+				return true;
+			}
+
+			void release(Graph &g) {
+				if (m_more) g.freeEdgeArray(m_more, m_capacity);
+				m_more = nullptr;
+				m_capacity = inline_capacity;
+				m_size = 0;
+			}
+
+			friend class Graph;
+		};
+
+		// NOTE position, charge and fixed should be changed through the graph (moveNode(), setFixed())
+		// or followed by a call to touchNode(), otherwise layout will not see the change
 		class Node {
 		public:
 			Node(initial3d::vec3f pos, float ele = 0, float sharp = 0) : position(pos.x(), pos.y(), 0), elevation(ele), sharpness(sharp) {  }
 
-			const std::unordered_set<Edge *> & getEdges() const { return edges; }
-			void addEdge(Edge *e) { edges.emplace(e); }
-			void removeEdge(Edge *e) { edges.erase(e); }
-			bool containsEdge(Edge *e) const { return edges.find(e) != edges.end(); }
+			// edges in the order they were added
+			const EdgeList & getEdges() const { return edges; }
+			bool containsEdge(Edge *e) const { return std::find(edges.begin(), edges.end(), e) != edges.end(); }
+
+			// unique within a graph; increases with order of creation
+			unsigned getID() const { return id; }
+
+			// position in Graph::getNodes(); changes when other nodes are deleted
+			unsigned getIndex() const { return index; }
 
 			Edge * findEdge(Node *n) {
 				for (Edge *e : edges) {
@@ -54,14 +145,33 @@ namespace skadi {
 				return 1;
 			}
 
-			float branch_priority() {
+			// r is uniform random in [0, 1)
+			float branch_priority(float r) {
 				// i think random branching works at least as well as any prioritzation ive come up with
-				static std::default_random_engine rand;
-				return std::uniform_real_distribution<float>(0.f, 1.f)(rand);
+				return r;
 			}
 
 		private:
-			std::unordered_set<Edge *> edges;
+			EdgeList edges;
+			unsigned id = 0;
+
+			// positions in the graph's node lists
+			unsigned index = unsigned(-1);
+			unsigned selected_index = unsigned(-1);
+			unsigned dirty_index = unsigned(-1);
+
+			// spatial index cell, and position within it
+			uint64_t grid_key = 0;
+			unsigned grid_index = unsigned(-1);
+
+			// made by a Batch that hasnt committed yet
+			bool batched = false;
+
+			// layout bookkeeping: state of this node in the static node tree
+			bool layout_static = false;
+			bool layout_active = false;
+			initial3d::float3 layout_position;
+			float layout_charge = 0.f;
 
 			friend class Graph;
 		};
@@ -78,6 +188,12 @@ namespace skadi {
 			Node * getNode1() { return node1; }
 			Node * getNode2() { return node2; }
 
+			// unique within a graph; increases with order of creation
+			unsigned getID() const { return id; }
+
+			// position in Graph::getEdges(); changes when other edges are deleted
+			unsigned getIndex() const { return index; }
+
 			Node *node1;
 			Node *node2;
 
@@ -85,6 +201,9 @@ namespace skadi {
 			float spring = 1000000.f;
 
 		private:
+			unsigned id = 0;
+			unsigned index = unsigned(-1);
+
 			Edge(Node *n1, Node *n2) : node1(n1), node2(n2) {
 				node1 = n1;
 				node2 = n2;
@@ -93,99 +212,680 @@ namespace skadi {
 			friend class Graph;
 		};
 
+		// layout integration method
+		enum class Integrator {
+			// explicit euler with fixed timestep and damping
+			euler,
+			// FIRE energy minimisation with adaptive timestep
+			fire
+		};
+
+		// axis-aligned rectangle in graph space (x and y)
+		struct Region {
+			float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+
+			bool empty() const {
+				return x0 > x1 || y0 > y1;
+			}
+
+			void add(const initial3d::float3 &p) {
+				x0 = std::min(x0, p.x());
+				y0 = std::min(y0, p.y());
+				x1 = std::max(x1, p.x());
+				y1 = std::max(y1, p.y());
+			}
+
+			void add(const Region &r) {
+				x0 = std::min(x0, r.x0);
+				y0 = std::min(y0, r.y0);
+				x1 = std::max(x1, r.x1);
+				y1 = std::max(y1, r.y1);
+			}
+
+			bool intersects(const Region &r) const {
+				return x0 <= r.x1 && r.x0 <= x1 && y0 <= r.y1 && r.y0 <= y1;
+			}
+		};
+
+		// Collects new nodes and edges and applies them to a graph together with commit(),
+		// with one reservation and one version change. Nodes from addNode() can be changed
+		// directly until then (including fixed and selected), but are not part of the graph yet.
+		// Uncommitted changes are discarded when the batch is destroyed.
+		class Batch {
+		public:
+			explicit Batch(Graph &g) : m_graph(g), m_split(g.edges.size(), 0) { }
+
+			Batch(const Batch &) = delete;
+			Batch & operator=(const Batch &) = delete;
+
+			~Batch() {
+				for (Node *n : m_nodes) {
+					n->~Node();
+					m_graph.node_pool.deallocate(n);
+				}
+			}
+
+			Node * addNode(initial3d::vec3f pos, float ele = 0, float sharp = 0) {
+				Node *n = new (m_graph.node_pool.allocate()) Node(pos, ele, sharp);
+				n->id = m_graph.next_id++;
+				n->batched = true;
+				m_nodes.push_back(n);
+				return n;
+			}
+
+			// on commit, edges to nodes deleted in the meantime are dropped;
+			// new nodes from this batch skip that check
+			void addEdge(Node *n1, Node *n2) {
+				m_edges.emplace_back(n1, n2);
+			}
+
+			// replace an existing edge with edges to and from a node.
+			// returns false (and does nothing) if the edge has already been split.
+			bool splitEdge(Edge *e, Node *n) {
+				if (isSplit(e)) return false;
+				// edges added to the graph after the batch was made
+				if (e->index >= m_split.size()) m_split.resize(e->index + 1, 0);
+				m_split[e->index] = 1;
+				m_split_edges.push_back(e);
+				addEdge(e->node1, n);
+				addEdge(n, e->node2);
+				return true;
+			}
+
+			bool isSplit(Edge *e) const {
+				return e->index < m_split.size() && m_split[e->index];
+			}
+
+			// apply everything; returns the new nodes
+			std::vector<Node *> commit() {
+				Graph &g = m_graph;
+				g.reserve(g.nodes.size() + m_nodes.size(), g.edges.size() + m_edges.size());
+				for (Node *n : m_nodes) {
+					listInsert(g.nodes, n, &Node::index);
+					listInsert(g.layout_dirty, n, &Node::dirty_index);
+					if (n->selected) listInsert(g.selected_nodes, n, &Node::selected_index);
+					if (g.grid_cell > 0.f) g.gridInsert(n);
+					if (g.recording) g.recordAddNode(n);
+					g.markChanged(n);
+				}
+				for (Edge *e : m_split_edges) {
+					g.deleteEdge(e);
+				}
+				for (auto &p : m_edges) {
+					if (p.first->batched || p.second->batched) {
+						// an existing end could have been deleted since
+						if ((p.first->batched || g.containsNode(p.first)) && (p.second->batched || g.containsNode(p.second))) {
+							g.linkNodes(p.first, p.second);
+						}
+					} else {
+						g.addEdge(p.first, p.second);
+					}
+				}
+				for (Node *n : m_nodes) {
+					n->batched = false;
+				}
+				g.layout_version++;
+				std::vector<Node *> r = std::move(m_nodes);
+				m_nodes.clear();
+				m_edges.clear();
+				m_split_edges.clear();
+				m_split.assign(g.edges.size(), 0);
+				return r;
+			}
+
+		private:
+			Graph &m_graph;
+			std::vector<Node *> m_nodes;
+			std::vector<std::pair<Node *, Node *>> m_edges;
+			std::vector<Edge *> m_split_edges;
+			// by edge index
+			std::vector<char> m_split;
+		};
+
 		Graph() {}
 
+		Graph(const Graph &) = delete;
+		Graph & operator=(const Graph &) = delete;
+
+		// nodes, edges and edge arrays all live in the pools, which are released a chunk at a time
+		~Graph() {
+			static_assert(std::is_trivially_destructible<Node>::value, "nodes are not destroyed individually");
+			static_assert(std::is_trivially_destructible<Edge>::value, "edges are not destroyed individually");
+		}
+
 		void select(Node *n, bool selected) {
-			n->selected = selected;
-			if (selected) {
-				selected_nodes.insert(n);
-			} else {
-				selected_nodes.erase(n);
+			if (recording) recordSelect(n, selected);
+			if (selected != n->selected) {
+				if (selected) {
+					listInsert(selected_nodes, n, &Node::selected_index);
+				} else {
+					listErase(selected_nodes, n, &Node::selected_index);
+				}
 			}
+			n->selected = selected;
+			layout_version++;
+			markChanged(n);
 		}
 
 		// Ensures an edge between the given nodes exists.
 		// Returns a new edge, or an existing equivalent one.
 		// Returns null if either node is not part of this graph.
 		Edge * addEdge(Node *n1, Node *n2) {
-			if (nodes.find(n1) != nodes.end() && nodes.find(n2) != nodes.end()) {
-				for (Edge *e : n1->getEdges()) {
-					if (e->other(n1) == n2) return e;
-				}
-				Edge *e = new Edge(n1, n2);
-				n1->addEdge(e);
-				n2->addEdge(e);
-				edges.insert(e);
-				return e;
+			if (containsNode(n1) && containsNode(n2)) {
+				return linkNodes(n1, n2);
 			}
 			return nullptr;
 		}
 
 		Node * addNode(initial3d::vec3f pos, float ele = 0, float sharp = 0) {
-			Node *n = new Node(pos, ele, sharp);
-			nodes.insert(n);
+			Node *n = new (node_pool.allocate()) Node(pos, ele, sharp);
+			n->id = next_id++;
+			listInsert(nodes, n, &Node::index);
+			if (grid_cell > 0.f) gridInsert(n);
+			touchNode(n);
+			if (recording) recordAddNode(n);
 			return n;
 		}
 
+		// fix or unfix a node in place
+		void setFixed(Node *n, bool fixed) {
+			if (recording) recordFixed(n, fixed);
+			n->fixed = fixed;
+			touchNode(n);
+		}
+
+		// move a node (other than by layout)
+		void moveNode(Node *n, const initial3d::float3 &d) {
+			if (recording) recordMove(n, d);
+			markChanged(nodeRegion(n));
+			n->position += d;
+			touchNode(n);
+		}
+
+		// change elevation, so it can be undone. elevation doesnt affect layout.
+		void setElevation(Node *n, float elevation) {
+			if (recording) recordElevation(n, elevation);
+			n->elevation = elevation;
+			markChanged(nodeRegion(n));
+		}
+
+		// notify the graph that the position, charge or fixed-ness of a node was changed directly.
+		// only the new position is marked as changed, so mark the old one first when moving.
+		void touchNode(Node *n) {
+			gridUpdate(n);
+			if (!listContains(layout_dirty, n, &Node::dirty_index)) listInsert(layout_dirty, n, &Node::dirty_index);
+			layout_version++;
+			markChanged(nodeRegion(n));
+		}
+
+		// NOTE nodes and edges must not be used after they are deleted
 		bool deleteEdge(Edge *e) {
-			auto it = edges.find(e);
-			if (it != edges.end()) {
-				e->getNode1()->removeEdge(e);
-				e->getNode2()->removeEdge(e);
-				edges.erase(it);
-				delete e;
+			if (containsEdge(e)) {
+				if (recording) recordDeleteEdge(e);
+				markChanged(e);
+				e->node1->edges.erase(e, *this);
+				e->node2->edges.erase(e, *this);
+				listErase(edges, e, &Edge::index);
+				e->~Edge();
+				edge_pool.deallocate(e);
 				return true;
 			}
 			return false;
 		}
 			
 		bool deleteNode(Node *n) {
-			auto it = nodes.find(n);
-			if (it != nodes.end()) {
-				selected_nodes.erase(n);
-				std::unordered_set<Edge *> edges0 = n->getEdges();
-				for (Edge *e : edges0) {
-					deleteEdge(e);
+			if (containsNode(n)) {
+				if (n->selected) listErase(selected_nodes, n, &Node::selected_index);
+				while (!n->getEdges().empty()) {
+					deleteEdge(n->getEdges()[0]);
 				}
-				nodes.erase(it);
+				// after the edges, so undo restores the node before its edges
+				if (recording) recordDeleteNode(n);
+				markChanged(n);
+				forgetLayoutNode(n);
+				if (grid_cell > 0.f) gridRemove(n);
+				listErase(nodes, n, &Node::index);
+				n->edges.release(*this);
+				n->~Node();
+				node_pool.deallocate(n);
 				return true;
 			}
 			return false;
 		}
 
+		// delete every node and edge, and forget edit history. pool memory is kept for reuse.
+		void clear() {
+			// from the back, so nothing needs to be moved
+			while (!nodes.empty()) {
+				deleteNode(nodes.back());
+			}
+			clearHistory();
+		}
 
-		const std::unordered_set<Node *> & getNodes() const {
+		// make room for adding many nodes and edges at once
+		void reserve(size_t node_count, size_t edge_count) {
+			nodes.reserve(node_count);
+			edges.reserve(edge_count);
+			layout_dirty.reserve(node_count);
+		}
+
+		bool containsNode(Node *n) const {
+			return listContains(nodes, n, &Node::index);
+		}
+
+		// A node pointer that can be kept while nodes are deleted. Deleted nodes go back to the
+		// pool and their memory may hold a new node later, so a plain pointer can't be checked.
+		struct NodeHandle {
+			Node *node = nullptr;
+			uint64_t generation = 0;
+		};
+
+		NodeHandle handle(Node *n) const {
+			NodeHandle h;
+			h.node = n;
+			if (n) h.generation = node_pool.generation(n);
+			return h;
+		}
+
+		// the node, or null if it has been deleted since the handle was made.
+		// doesnt touch the node itself, so is fine after it has been freed.
+		Node * resolve(const NodeHandle &h) const {
+			return h.node && node_pool.generation(h.node) == h.generation ? h.node : nullptr;
+		}
+
+		bool containsEdge(Edge *e) const {
+			return listContains(edges, e, &Edge::index);
+		}
+
+		// nodes are stored densely; deleting a node moves the last one into its place
+		const std::vector<Node *> & getNodes() const {
 			return nodes;
 		}
 
-		const std::unordered_set<Edge *> & getEdges() const {
+		// edges are stored densely; deleting an edge moves the last one into its place
+		const std::vector<Edge *> & getEdges() const {
 			return edges;
 		}
 
-		const std::unordered_set<Node *> & getSelectedNodes() const {
+		const std::vector<Node *> & getSelectedNodes() const {
 			return selected_nodes;
 		}
 
 		void clearSelection() {
 			for (Node *n : selected_nodes) {
+				if (recording) recordSelect(n, false);
 				n->selected = false;
+				n->selected_index = unsigned(-1);
+				markChanged(n);
 			}
 			selected_nodes.clear();
+			layout_version++;
+		}
+
+		// Edit history. Changes made through the graph between beginEdit() and endEdit()
+		// are undone and redone together; edits may nest. Changes outside an edit (like
+		// layout and automatic expansion) are not recorded. Only the changes themselves
+		// are stored, so undo and redo cost is proportional to the size of the edit.
+		// Implemented in Journal.cpp.
+		void beginEdit();
+		void endEdit();
+		// inside beginEdit() / endEdit()
+		bool isEditing() const;
+		bool undo();
+		bool redo();
+		void clearHistory();
+
+		// bytes used by edit history
+		size_t historySize() const;
+
+		// nodes within some distance of a point
+		std::vector<Node *> findNodes(const initial3d::float3 &p, float radius) {
+			std::vector<Node *> r;
+			gridQuery(p, radius, [&](Node *n) {
+				if ((n->position - p).mag() <= radius) r.push_back(n);
+			});
+			return r;
+		}
+
+		// closest node strictly within some distance of a point, or null
+		Node * findClosestNode(const initial3d::float3 &p, float radius, Node *exclude = nullptr) {
+			Node *r = nullptr;
+			float d = radius;
+			gridQuery(p, radius, [&](Node *n) {
+				if (n == exclude) return;
+				float d1 = (n->position - p).mag();
+				if (d1 < d || (d1 == d && r && n->id < r->id)) {
+					r = n;
+					d = d1;
+				}
+			});
+			return r;
+		}
+
+		// nodes or edges in order of id, for deterministic iteration
+		template <typename ContainerT>
+		static std::vector<typename ContainerT::value_type> sortByID(const ContainerT &xs) {
+			std::vector<typename ContainerT::value_type> r(xs.begin(), xs.end());
+			std::sort(r.begin(), r.end(), [](const typename ContainerT::value_type &a, const typename ContainerT::value_type &b) { return a->id < b->id; });
+			return r;
+		}
+
+		// random engine for graph edits; seed it for reproducible results
+		std::default_random_engine & random() {
+			return rand_engine;
+		}
+
+		void seed(unsigned s) {
+			rand_engine.seed(s);
+		}
+
+		// incremented whenever nodes are added, deleted, (un)fixed, touched or (de)selected.
+		// does not change when nodes are moved by layout.
+		unsigned long long getLayoutVersion() const {
+			return layout_version;
+		}
+
+		// incremented by every change to anything that is drawn, including layout
+		unsigned long long getVersion() const {
+			return version;
+		}
+
+		// Adds the parts of the graph that changed after some version to a list of regions.
+		// A node change covers the node and its neighbours, since their edges change too.
+		// Regions are merged where they overlap, so there are not many.
+		// Returns false if the version is too old to know, in which case treat everything as changed.
+		bool getChangedRegions(unsigned long long since, std::vector<Region> &regions) const {
+			if (since < changes_floor) return false;
+			for (auto it = changes.rbegin(); it != changes.rend() && it->first > since; ++it) {
+				regions.push_back(it->second);
+			}
+			return true;
 		}
 
 		// attempt some number of layout steps.
-		// stops when average speed drops below threshold.
+		// stops when average displacement per step drops below threshold.
 		// returns number of steps actually taken.
-		int doLayout(int steps, const std::unordered_set<Node *> &active_nodes);
+		// results only depend on the graph, not on thread count or node addresses.
+		int doLayout(int steps, const std::vector<Node *> &active_nodes);
+
+		// multilevel layout: coarsen the graph by repeated edge matching, lay out the coarsest
+		// graph, then move each finer level into place and refine it with doLayout().
+		// each level takes at most the given number of steps.
+		// returns total number of steps actually taken over all levels.
+		int doMultilevelLayout(int steps, const std::vector<Node *> &active_nodes);
+
+		void setIntegrator(Integrator i) {
+			integrator = i;
+			fire = fire_state();
+			fire.dt = timestep;
+		}
+
+		Integrator getIntegrator() const {
+			return integrator;
+		}
+
+		static const char * integratorName(Integrator i) {
+			switch (i) {
+			case Integrator::euler:
+				return "Euler";
+			case Integrator::fire:
+				return "FIRE";
+			default:
+				return "?";
+			}
+		}
 
 	private:
-		std::unordered_set<Node *> nodes;
-		std::unordered_set<Edge *> edges;
+		// cached tree of nodes that will not move during layout; defined in Layout.cpp
+		class LayoutCache;
+		// storage for nodes, edges, and node edge lists that outgrow their inline storage
+		// with generations, for NodeHandle
+		BlockPool node_pool { sizeof(Node), true };
+		BlockPool edge_pool { sizeof(Edge) };
+		std::vector<BlockPool> edge_array_pools;
+
+		std::vector<Node *> nodes;
+		std::vector<Edge *> edges;
+
+		std::vector<Node *> selected_nodes;
 
-		std::unordered_set<Node *> selected_nodes;
+		unsigned next_id = 0;
+		unsigned next_edge_id = 0;
+		std::default_random_engine rand_engine;
 
 		// for layout
 		float timestep = 0.0001;
+		Integrator integrator = Integrator::fire;
+
+		// FIRE integrator state, kept between layout calls
+		struct fire_state {
+			float dt = 0.0001f;
+			float alpha = 0.1f;
+			// steps since power was last negative
+			int count = 0;
+			// steps with small displacement
+			int still = 0;
+		} fire;
+
+		// spatial index: uniform grid over x and y, hashed so it is unbounded.
+		// built by the first query (so graphs that are never queried dont pay for it),
+		// then kept up to date as nodes are added, deleted and moved.
+		std::unordered_map<uint64_t, std::vector<Node *>> grid;
+		float grid_cell = 0.f;
+		size_t grid_count = 0;
+
+		// addEdge() for nodes known to be in this graph
+		Edge * linkNodes(Node *n1, Node *n2) {
+			// search the shorter edge list for an existing edge
+			Node *m = n1->edges.size() <= n2->edges.size() ? n1 : n2;
+			for (Edge *e : m->getEdges()) {
+				if (e->other(m) == (m == n1 ? n2 : n1)) return e;
+			}
+			Edge *e = new (edge_pool.allocate()) Edge(n1, n2);
+			e->id = next_edge_id++;
+			n1->edges.push_back(e, *this);
+			if (n2 != n1) n2->edges.push_back(e, *this);
+			listInsert(edges, e, &Edge::index);
+			if (recording) recordAddEdge(e);
+			markChanged(e);
+			return e;
+		}
+
+		// edit history, created by the first edit
+		class Journal;
+		std::shared_ptr<Journal> journal;
+		bool recording = false;
+
+		// change tracking: (version, region) in order of version.
+		// the last region grows while changes overlap it.
+		static const size_t max_changes = 256;
+		unsigned long long version = 0;
+		std::vector<std::pair<unsigned long long, Region>> changes;
+		// changes up to here have been forgotten
+		unsigned long long changes_floor = 0;
+
+		// a node and its edges
+		static Region nodeRegion(Node *n) {
+			Region r;
+			r.add(n->position);
+			for (Edge *e : n->getEdges()) {
+				r.add(e->other(n)->position);
+			}
+			return r;
+		}
+
+		// some nodes and their edges
+		static Region nodeRegion(const std::vector<Node *> &ns) {
+			Region r;
+			for (Node *n : ns) {
+				r.add(nodeRegion(n));
+			}
+			return r;
+		}
+
+		void markChanged(Node *n) {
+			Region r;
+			r.add(n->position);
+			markChanged(r);
+		}
+
+		void markChanged(Edge *e) {
+			Region r;
+			r.add(e->node1->position);
+			r.add(e->node2->position);
+			markChanged(r);
+		}
+
+		void markChanged(const Region &r) {
+			version++;
+			if (!changes.empty() && changes.back().second.intersects(r)) {
+				changes.back().first = version;
+				changes.back().second.add(r);
+				return;
+			}
+			if (changes.size() >= max_changes) {
+				// forget the oldest half
+				changes_floor = changes[max_changes / 2 - 1].first;
+				changes.erase(changes.begin(), changes.begin() + max_changes / 2);
+			}
+			changes.emplace_back(version, r);
+		}
+
+		// nodes changed since the last layout call
+		std::vector<Node *> layout_dirty;
+		unsigned long long layout_version = 0;
+		std::shared_ptr<LayoutCache> layout_cache;
+
+		uint64_t gridKey(const initial3d::float3 &p) const {
+			return gridKey(gridCoord(p.x()), gridCoord(p.y()));
+		}
+
+		uint64_t gridKey(int x, int y) const {
+			return (uint64_t(uint32_t(x)) << 32) | uint32_t(y);
+		}
+
+		int gridCoord(float v) const {
+			return int(std::floor(std::max(-1e9f, std::min(v / grid_cell, 1e9f))));
+		}
+
+		void gridInsert(Node *n) {
+			n->grid_key = gridKey(n->position);
+			listInsert(grid[n->grid_key], n, &Node::grid_index);
+		}
+
+		void gridRemove(Node *n) {
+			// empty cells are kept; they are dropped when the grid is rebuilt
+			listErase(grid[n->grid_key], n, &Node::grid_index);
+		}
+
+		// move a node to the right cell if its position has changed
+		void gridUpdate(Node *n) {
+			if (grid_cell > 0.f && gridKey(n->position) != n->grid_key) {
+				gridRemove(n);
+				gridInsert(n);
+			}
+		}
+
+		// size cells for a few nodes each, over the current bounds
+		void gridBuild() {
+			using namespace initial3d;
+			grid.clear();
+			float3 lo(0.f), hi(1.f);
+			if (!nodes.empty()) {
+				lo = hi = nodes[0]->position;
+				for (Node *n : nodes) {
+					lo = float3::min(lo, n->position);
+					hi = float3::max(hi, n->position);
+				}
+			}
+			const float area = std::max((hi.x() - lo.x()) * (hi.y() - lo.y()), 1e-6f);
+			grid_cell = std::sqrt(4.f * area / std::max(nodes.size(), size_t(1)));
+			grid_count = nodes.size();
+			for (Node *n : nodes) {
+				gridInsert(n);
+			}
+		}
+
+		template <typename FunT>
+		void gridQuery(const initial3d::float3 &p, float radius, const FunT &f) {
+			// rebuild if the node count has changed a lot, so cells stay reasonably sized
+			if (grid_cell <= 0.f || nodes.size() > 4 * grid_count + 64 || 4 * nodes.size() + 64 < grid_count || grid.size() > 4 * nodes.size() + 64) {
+				gridBuild();
+			}
+			const int x0 = gridCoord(p.x() - radius), x1 = gridCoord(p.x() + radius);
+			const int y0 = gridCoord(p.y() - radius), y1 = gridCoord(p.y() + radius);
+			if ((int64_t(x1) - x0 + 1) * (int64_t(y1) - y0 + 1) > int64_t(grid.size())) {
+				// query covers more cells than exist, visit them all
+				for (auto &c : grid) {
+					for (Node *n : c.second) f(n);
+				}
+			} else {
+				for (int x = x0; x <= x1; x++) {
+					for (int y = y0; y <= y1; y++) {
+						auto it = grid.find(gridKey(x, y));
+						if (it == grid.end()) continue;
+						for (Node *n : it->second) f(n);
+					}
+				}
+			}
+		}
+
+		// edge arrays have power of 2 capacities, each with its own pool
+		Edge ** allocEdgeArray(unsigned capacity) {
+			size_t i = 0;
+			while ((EdgeList::inline_capacity << (i + 1)) < capacity) i++;
+			while (edge_array_pools.size() <= i) {
+				edge_array_pools.emplace_back((EdgeList::inline_capacity << (edge_array_pools.size() + 1)) * sizeof(Edge *));
+			}
+			return reinterpret_cast<Edge **>(edge_array_pools[i].allocate());
+		}
+
+		void freeEdgeArray(Edge **p, unsigned capacity) {
+			size_t i = 0;
+			while ((EdgeList::inline_capacity << (i + 1)) < capacity) i++;
+			edge_array_pools[i].deallocate(p);
+		}
+
+		// dense lists of nodes or edges, where each element knows its own position
+		template <typename T>
+		static void listInsert(std::vector<T *> &v, T *x, unsigned T::*index) {
+			x->*index = v.size();
+			v.push_back(x);
+		}
+
+		template <typename T>
+		static void listErase(std::vector<T *> &v, T *x, unsigned T::*index) {
+			T *y = v.back();
+			y->*index = x->*index;
+			v[x->*index] = y;
+			v.pop_back();
+			x->*index = unsigned(-1);
+		}
+
+		template <typename T>
+		static bool listContains(const std::vector<T *> &v, T *x, unsigned T::*index) {
+			return x->*index < v.size() && v[x->*index] == x;
+		}
+
+		// record changes for edit history, while an edit is open
+		void recordAddNode(Node *n);
+		void recordDeleteNode(Node *n);
+		void recordAddEdge(Edge *e);
+		void recordDeleteEdge(Edge *e);
+		void recordMove(Node *n, const initial3d::float3 &d);
+		void recordFixed(Node *n, bool fixed);
+		void recordSelect(Node *n, bool selected);
+		void recordElevation(Node *n, float elevation);
+
+		// bring the static node tree up to date for a new set of active nodes
+		void updateLayoutCache(const std::vector<Node *> &active_nodes);
+
+		// remove a node that is about to be deleted from the layout cache
+		void forgetLayoutNode(Node *n);
+
+		// integrate one layout step; returns true if converged
+		bool stepEuler(const std::vector<Node *> &nodes0, const std::vector<initial3d::float3> &forces);
+		bool stepFIRE(const std::vector<Node *> &nodes0, const std::vector<initial3d::float3> &forces);
 
 	};
 }
\ No newline at end of file
@@ -1,13 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <unordered_map>
 #include <vector>
 #include <memory>
 #include <random>
 #include <string>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <functional>
+
+#include <omp.h>
 
 #include "Camera.hpp"
+#include "Concurrent.hpp"
 #include "Graph.hpp"
+#include "GraphFile.hpp"
 #include "GL.hpp"
 #include "Initial3D.hpp"
 #include "SimpleShader.hpp"
@@ -59,7 +70,7 @@ namespace skadi {
 			// Listen for mouse movement
 			//
 			weproxy->onMouseMove.subscribe([&](const gecom::mouse_event &e) {
-				if (brush->isActive()) {
+				if (stroke_brush) {
 					// Move the brush
 					initial3d::vec3f oldPos = brush_position;
 					brush_position = initial3d::vec3f(e.pos.x, e.pos.y, 0);
@@ -69,7 +80,8 @@ namespace skadi {
 					initial3d::vec3f brush_mov_g = brush_pos_g - windowToGraph(oldPos);
 					float brush_rad_g = (brush_pos_g - windowToGraph(brush_position + ~initial3d::vec3f(1, 1, 0) * brush_radius)).mag();
 
-					brush->step(brush_pos_g, brush_rad_g, brush_mov_g, graph);
+					Brush *b = stroke_brush;
+					post([=]() { b->step(brush_pos_g, brush_rad_g, brush_mov_g, graph); });
 				}
 				brush_position = initial3d::vec3f(e.pos.x, e.pos.y, 0);
 				return false; // Nessesary
@@ -78,16 +90,21 @@ namespace skadi {
 			// Listen for mouse click
 			//
 			weproxy->onMouseButtonPress.subscribe([&](const gecom::mouse_button_event &e) {
-				if (!brush->isActive()) {
+				if (!stroke_brush && (e.button == GLFW_MOUSE_BUTTON_1 || e.button == GLFW_MOUSE_BUTTON_2)) {
 					// Calculate What nodes are in area
 					initial3d::vec3f brush_pos_g = windowToGraph(brush_position);
 					float brush_rad_g = (brush_pos_g - windowToGraph(brush_position + ~initial3d::vec3f(1, 1, 0) * brush_radius)).mag();
 
-					if (e.button == GLFW_MOUSE_BUTTON_1) {
-						brush->activate(brush_pos_g, brush_rad_g, graph, false);
-					}else if (e.button == GLFW_MOUSE_BUTTON_2) {
-						brush->activate(brush_pos_g, brush_rad_g, graph, true);
-					}
+					// brushes only run on the layout thread; remember the stroke here
+					Brush *b = brush;
+					bool alt = e.button == GLFW_MOUSE_BUTTON_2;
+					stroke_brush = b;
+					stroke_button = e.button;
+					// a whole stroke is undone at once
+					post([=]() {
+						graph->beginEdit();
+						b->activate(brush_pos_g, brush_rad_g, graph, alt);
+					});
 				}
 				return false; // Nessesary
 			}).forever();
@@ -97,13 +114,13 @@ namespace skadi {
 				initial3d::vec3f brush_pos_g = windowToGraph(brush_position);
 				float brush_rad_g = (brush_pos_g - windowToGraph(brush_position + ~initial3d::vec3f(1, 1, 0) * brush_radius)).mag();
 
-				if (brush->isActive()) {
-					if (e.button == GLFW_MOUSE_BUTTON_1 && !brush->isAlt()) {
-						brush->deactivate(brush_pos_g, brush_rad_g, graph);
-					}
-					else if (e.button == GLFW_MOUSE_BUTTON_2 && brush->isAlt()) {
-						brush->deactivate(brush_pos_g, brush_rad_g, graph);
-					}
+				if (stroke_brush && e.button == stroke_button) {
+					Brush *b = stroke_brush;
+					post([=]() {
+						b->deactivate(brush_pos_g, brush_rad_g, graph);
+						graph->endEdit();
+					});
+					stroke_brush = nullptr;
 				}
 				return false; // Nessesary
 			}).forever();
@@ -130,15 +147,38 @@ namespace skadi {
 
 				// clear selection
 				if (e.key == GLFW_KEY_R) {
-					graph->clearSelection();
+					post([=]() {
+						graph->beginEdit();
+						graph->clearSelection();
+						graph->endEdit();
+					});
 				}
 
 				// delete selection
 				if (e.key == GLFW_KEY_DELETE) {
-					std::unordered_set<Graph::Node *> sel = graph->getSelectedNodes();
-					for (Graph::Node *n : sel) {
-						graph->deleteNode(n);
-					}
+					post([=]() {
+						graph->beginEdit();
+						std::vector<Graph::Node *> sel = graph->getSelectedNodes();
+						for (Graph::Node *n : sel) {
+							graph->deleteNode(n);
+						}
+						graph->endEdit();
+					});
+				}
+
+				// undo / redo
+				if (e.key == GLFW_KEY_Z && (e.mods & GLFW_MOD_CONTROL)) {
+					bool redo = e.mods & GLFW_MOD_SHIFT;
+					post([=]() {
+						bool done = redo ? graph->redo() : graph->undo();
+						if (!done) std::cout << "Nothing to " << (redo ? "redo" : "undo") << std::endl;
+					});
+				}
+
+				if (e.key == GLFW_KEY_Y && (e.mods & GLFW_MOD_CONTROL)) {
+					post([=]() {
+						if (!graph->redo()) std::cout << "Nothing to redo" << std::endl;
+					});
 				}
 
 				// make heightmap
@@ -148,14 +188,58 @@ namespace skadi {
 
 				// enable / disable layout
 				if (e.key == GLFW_KEY_L) {
-					should_do_layout = !should_do_layout;
-					std::cout << "Layout enabled: " << should_do_layout << std::endl;
+					post([=]() {
+						should_do_layout = !should_do_layout;
+						std::cout << "Layout enabled: " << should_do_layout << std::endl;
+					});
+				}
+
+				// one-off multilevel layout, for fast global convergence
+				if (e.key == GLFW_KEY_M) {
+					post([=]() {
+						int steps = doMultilevelLayout();
+						std::cout << "Multilevel layout took " << steps << " steps" << std::endl;
+					});
+				}
+
+				// switch layout integrator
+				if (e.key == GLFW_KEY_I) {
+					post([=]() {
+						Graph::Integrator i = graph->getIntegrator() == Graph::Integrator::euler ? Graph::Integrator::fire : Graph::Integrator::euler;
+						graph->setIntegrator(i);
+						std::cout << "Layout integrator: " << Graph::integratorName(i) << std::endl;
+					});
+				}
+
+				// save / load graph
+				if (e.key == GLFW_KEY_F5) {
+					post([=]() {
+						try {
+							GraphFile::save(*graph, graph_path);
+							gecom::log("Editor") << "Saved graph to " << graph_path;
+						} catch (graph_file_error &err) {
+							gecom::log("Editor").error() << err.what();
+						}
+					});
+				}
+
+				if (e.key == GLFW_KEY_F9) {
+					post([=]() {
+						try {
+							GraphFile::load(graph_path, *graph);
+							gecom::log("Editor") << "Loaded graph from " << graph_path;
+						} catch (graph_file_error &err) {
+							gecom::log("Editor").error() << err.what();
+						}
+					});
 				}
 
 				// enable / disable automatic edge splitting and node branching
 				if (e.key == GLFW_KEY_K) {
-					should_expand_graph = !should_expand_graph;
-					std::cout << "Graph expansion enabled: " << should_expand_graph << std::endl;
+					post([=]() {
+						should_expand_graph = !should_expand_graph;
+						std::cout << "Graph expansion enabled: " << should_expand_graph << std::endl;
+					});
 				}
 
 				return false;
@@ -177,7 +261,7 @@ namespace skadi {
 			//Graph::Node *n8 = graph->addNode(initial3d::vec3f(0.62, 0.9, 0),  0.7, 0.0);
 			//Graph::Node *n9 = graph->addNode(initial3d::vec3f(0.76, 0.82, 0), 0.7, 0.0);
 
-			n1->fixed = true;
+			graph->setFixed(n1, true);
 
 			//graph->addEdge(n1, n2);
 			//graph->addEdge(n1, n3);
@@ -196,6 +280,33 @@ namespace skadi {
 			glGenVertexArrays(1, &vao_brush);
 			glGenBuffers(1, &vbo_brush_angles);
 
+			// graph vertex layout; edges share the node positions.
+			// buffer contents are uploaded by uploadGraph()
+			glBindBuffer(GL_ARRAY_BUFFER, vbo_node_pos);
+			glBindVertexArray(vao_node);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, nullptr);
+			glBindVertexArray(vao_edge);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_edge_idx);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, nullptr);
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			// brush circle; just angles, the shader does the rest
+			std::vector<float> angles;
+			for (int i = 0; i < brush_vertex_count; i++) {
+				float a = 2.0 * initial3d::math::pi() * i / double(brush_vertex_count);
+				angles.push_back(a);
+			}
+			glBindVertexArray(vao_brush);
+			glBindBuffer(GL_ARRAY_BUFFER, vbo_brush_angles);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * angles.size(), &angles[0], GL_STATIC_DRAW);
+			glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 0, nullptr);
+			glEnableVertexAttribArray(0);
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
 			static const char *node_shader_prog_src = R"delim(
 
 			uniform mat4 modelViewMatrix;
@@ -369,10 +480,27 @@ namespace skadi {
 
 			)delim";
 
-			shdr_node = makeShaderProgram("330 core", { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER }, node_shader_prog_src);
-			shdr_edge = makeShaderProgram("330 core", { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, edge_shader_prog_src);
-			shdr_brush = makeShaderProgram("330 core", { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, brush_shader_prog_src);
+			shdr_node = shader_program<graph_uniforms>("330 core", { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER }, node_shader_prog_src);
+			shdr_edge = shader_program<graph_uniforms>("330 core", { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, edge_shader_prog_src);
+			shdr_brush = shader_program<brush_uniforms>("330 core", { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, brush_shader_prog_src);
+
+			// start simulating; from here on the graph belongs to the layout thread
+			// openmp thread count is per-thread, so pass on what main() set up
+			layout_threads = omp_get_max_threads();
+			publishSnapshot();
+			layout_thread = std::thread([this]() { layoutMain(); });
+
+		}
+
+		~GraphEditor() {
+			post([this]() { layout_quit = true; });
+			layout_thread.join();
+		}
 
+		// run a function on the layout thread.
+		// the graph (and brushes) must only be used from there once the editor is constructed.
+		void post(const std::function<void()> &f) {
+			layout_commands.push(f);
 		}
 
 		void update() {
@@ -390,18 +518,24 @@ namespace skadi {
 			glfwGetCursorPos(window->handle(), &mme.pos.x, &mme.pos.y);
 			weproxy->dispatchMouseEvent(mme);
 
-			active_node_count = 0;
-			if (should_do_layout) {
-				if (doLayout() && should_expand_graph) {
-					subdivideAndBranch();
-				}
-			}
-
 			if (should_make_hmap) {
 				makeHeightmap();
 				should_make_hmap = false;
 			}
 
+			// install heightmap once the layout thread has made it
+			if (hmap_future.valid() && hmap_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+				std::vector<float> ele = hmap_future.get();
+				int w = hmap->getMeshWidth();
+				if (ele.empty()) {
+					gecom::log("Editor") << "Heightmap is up to date";
+				} else {
+					// streamed in the background if there is a free upload buffer
+					if (!hmap->setHeightsAsync(std::move(ele), w + 1, w + 1)) hmap->setHeights(&ele[0], w + 1, w + 1);
+					gecom::log("Editor") << "Heightmap creation finished";
+				}
+			}
+
 		}
 
 		void draw() {
@@ -422,94 +556,8 @@ namespace skadi {
 		}
 
 		void draw_graph(const initial3d::mat4f &view_mat, const initial3d::mat4f &proj_mat) {
-
-			using namespace std;
-			using namespace initial3d;
-
-			
-
-			// mat4d view_matrix = !camera->getViewTransform();
-
-			vector<float> nodePos;
-			vector<GLuint> edgeIdx;
-			unordered_map<Graph::Node *, GLuint> nodeToIdx;
-
-			// prevent divide by 0
-			float elevation_max = 0.01f;
-
-			for (Graph::Node *node : graph->getNodes()) {
-				nodeToIdx[node] = nodePos.size() / 4;
-				vec3f pos = node->position;
-				nodePos.push_back(pos.x());
-				nodePos.push_back(pos.y());
-				nodePos.push_back(node->elevation);
-				elevation_max = max(elevation_max, node->elevation);
-				// bithacks - flags as bits in a float
-				GLuint flags = 0;
-				flags |= GLuint(node->selected) << 0;
-				flags |= GLuint(node->fixed) << 1;
-				nodePos.push_back(reinterpret_cast<float &>(flags));
-			}
-
-			for (Graph::Edge *edge : graph->getEdges()) {
-				edgeIdx.push_back(nodeToIdx[edge->getNode1()]);
-				edgeIdx.push_back(nodeToIdx[edge->getNode2()]);
-			}
-
-			// Bind node VAO for Nodes
-			//
-			glBindVertexArray(vao_node);
-
-			// Upload positions
-			//
-			glBindBuffer(GL_ARRAY_BUFFER, vbo_node_pos);
-			if (nodePos.empty()) {
-				glBufferData(GL_ARRAY_BUFFER, 4 * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
-			} else {
-				glBufferData(GL_ARRAY_BUFFER, nodePos.size() * sizeof(float), &nodePos[0], GL_DYNAMIC_DRAW);
-			}
-			glEnableVertexAttribArray(0);
-			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, nullptr);
-
-			// Bind node VAO for Nodes
-			//
-			glBindVertexArray(vao_edge);
-
-			// Upload indices
-			//
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_edge_idx); // this sticks to the vao
-			if (edgeIdx.empty()) {
-				glBufferData(GL_ELEMENT_ARRAY_BUFFER, 1 * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
-			} else {
-				glBufferData(GL_ELEMENT_ARRAY_BUFFER, edgeIdx.size() * sizeof(GLuint), &edgeIdx[0], GL_DYNAMIC_DRAW);
-			}
-
-			// Upload positions
-			//
-			glBindBuffer(GL_ARRAY_BUFFER, vbo_node_pos);
-			glEnableVertexAttribArray(0);
-			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, nullptr);
-
-
-			
-
-			//Actual Draw Calls
-			//
-			glUseProgram(shdr_node);
-			glUniformMatrix4fv(glGetUniformLocation(shdr_node, "modelViewMatrix"), 1, true, view_mat);
-			glUniformMatrix4fv(glGetUniformLocation(shdr_node, "projectionMatrix"), 1, true, proj_mat);
-
-			glBindVertexArray(vao_node);
-			glDrawArrays(GL_POINTS, 0, nodePos.size() / 4);
-
-
-			glUseProgram(shdr_edge);
-			glUniformMatrix4fv(glGetUniformLocation(shdr_edge, "modelViewMatrix"), 1, true, view_mat);
-			glUniformMatrix4fv(glGetUniformLocation(shdr_edge, "projectionMatrix"), 1, true, proj_mat);
-			glUniform1f(glGetUniformLocation(shdr_edge, "elevationMax"), elevation_max);
-
-			glBindVertexArray(vao_edge);
-			glDrawElements(GL_LINES, edgeIdx.size(), GL_UNSIGNED_INT, nullptr);
+			// latest graph from the layout thread
+			draw_graph(view_mat, proj_mat, snapshot());
 		}
 
 		void draw_graph() {
@@ -544,29 +592,14 @@ namespace skadi {
 
 			glBindVertexArray(vao_brush);
 
-			std::vector<float> angles;
-
-			for (int i = 0; i < 1000; i++) {
-				float a = 2.0 * initial3d::math::pi() * i / (1000.0);
-				angles.push_back(a);
-			}
-
-			glBindVertexArray(vao_brush);
-			glBindBuffer(GL_ARRAY_BUFFER, vbo_brush_angles);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float)* angles.size(), &angles[0], GL_STATIC_DRAW);
-			glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 0, nullptr);
-			glEnableVertexAttribArray(0);
-
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-			glUseProgram(shdr_brush);
+			const brush_uniforms &u = shdr_brush.use();
 
-			glUniform2f(glGetUniformLocation(shdr_brush, "pos"), brush_position.x(), brush_position.y());
-			glUniform1f(glGetUniformLocation(shdr_brush, "radius"), brush_radius);
-			glUniformMatrix4fv(glGetUniformLocation(shdr_brush, "proj_matrix"), 1, true, proj_mat);
-			glUniform1f(glGetUniformLocation(shdr_brush, "time"), fmod(glfwGetTime(), initial3d::math::pi() * 32.0));
+			u.pos.set(brush_position.x(), brush_position.y());
+			u.radius.set(brush_radius);
+			u.proj_matrix.set(proj_mat);
+			u.time.set(fmod(glfwGetTime(), initial3d::math::pi() * 32.0));
 
-			glDrawArrays(GL_LINE_LOOP, 0, 1000);
+			glDrawArrays(GL_LINE_LOOP, 0, brush_vertex_count);
 		}
 
 
@@ -618,40 +651,81 @@ namespace skadi {
 
 			)delim";
 
-			static GLuint prog_box = 0;
-
-			if (prog_box == 0) {
-				prog_box = makeShaderProgram("330 core", { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER }, prog_box_src);
+			if (!shdr_box) {
+				shdr_box = shader_program<graph_uniforms>("330 core", { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER }, prog_box_src);
 			}
 
 			mat4f proj_mat = get_graph_proj_mat(w, h);
 			mat4f view_mat = camera->getViewTransform();
 
-			glUseProgram(prog_box);
-			glUniformMatrix4fv(glGetUniformLocation(prog_box, "modelViewMatrix"), 1, true, view_mat);
-			glUniformMatrix4fv(glGetUniformLocation(prog_box, "projectionMatrix"), 1, true, proj_mat);
+			const graph_uniforms &u = shdr_box.use();
+			u.modelViewMatrix.set(view_mat);
+			u.projectionMatrix.set(proj_mat);
 			gecom::draw_dummy();
 
 		}
 
+		// graph texture, redrawn only where the graph has changed since it was last drawn
 		GLuint makeGraphTexture() {
 
 			using namespace initial3d;
 
+			// one snapshot for the whole texture, even if a newer one arrives meanwhile
+			const graph_snapshot &snap = snapshot();
+			if (snap.version == tex_graph_version) return tex_graph;
+
+			// graph space [0, 1] covers the texture
+			mat4f view_mat = mat4f::scale(graph_tex_width, graph_tex_width, 1) * mat4f::translate(-0.5f, -0.5f, 0);
+			mat4f proj_mat = get_graph_proj_mat(graph_tex_width, graph_tex_width);
+
+			// tiles to redraw, as one rectangle [x0, x1] * [y0, y1]; only changes since the last drawn
+			// version can be used, and edge colour depends on max elevation
+			const int tiles = graph_tex_width / graph_tex_tile;
+			int tx0 = tiles, ty0 = tiles, tx1 = -1, ty1 = -1;
+			bool partial = tex_graph_version != no_version && snap.prev_version == tex_graph_version && snap.changed_known && snap.elevation_max == tex_graph_elevation_max;
+			if (partial) {
+				// tile holding a graph coordinate; clamped before converting, as nodes can be anywhere
+				auto tile = [&](float t) {
+					t = std::floor(t * tiles);
+					return t > 0 ? int(std::min(t, float(tiles - 1))) : 0;
+				};
+				for (const Graph::Region &r : snap.changed) {
+					// pad for node quads and lines
+					const float pad = 4.f / graph_tex_width;
+					tx0 = std::min(tx0, tile(r.x0 - pad));
+					ty0 = std::min(ty0, tile(r.y0 - pad));
+					tx1 = std::max(tx1, tile(r.x1 + pad));
+					ty1 = std::max(ty1, tile(r.y1 + pad));
+				}
+				// every node and edge is drawn either way, so a scissor only saves fill;
+				// only worth it when it skips most of the texture
+				partial = tx1 < tx0 || (tx1 - tx0 + 1) * (ty1 - ty0 + 1) <= tiles * tiles / 4;
+			}
+
 			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_graph);
 			glViewport(0, 0, graph_tex_width, graph_tex_width);
 
 			glClearColor(1.f, 1.f, 1.f, 1.f);
 
-			glClear(GL_COLOR_BUFFER_BIT);
-
-			mat4f view_mat = mat4f::scale(graph_tex_width, graph_tex_width, 1) * mat4f::translate(-0.5f, -0.5f, 0);
-			mat4f proj_mat = get_graph_proj_mat(graph_tex_width, graph_tex_width);
-
-			draw_graph(view_mat, proj_mat);
+			if (partial) {
+				// clear and redraw the changed tiles in one pass, if anything changed
+				if (tx0 <= tx1) {
+					glEnable(GL_SCISSOR_TEST);
+					glScissor(tx0 * graph_tex_tile, ty0 * graph_tex_tile, (tx1 - tx0 + 1) * graph_tex_tile, (ty1 - ty0 + 1) * graph_tex_tile);
+					glClear(GL_COLOR_BUFFER_BIT);
+					draw_graph(view_mat, proj_mat, snap);
+					glDisable(GL_SCISSOR_TEST);
+				}
+			} else {
+				glClear(GL_COLOR_BUFFER_BIT);
+				draw_graph(view_mat, proj_mat, snap);
+			}
 
 			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
+			tex_graph_version = snap.version;
+			tex_graph_elevation_max = snap.elevation_max;
+
 			return tex_graph;
 
 		}
@@ -663,112 +737,171 @@ namespace skadi {
 			// check for square and POT
 			assert(w == h);
 			assert((w != 0) && ((w & (w - 1)) == 0));
-			// convert edges to heightmap
-			gecom::log("Editor") << "Beginning heightmap creation...";
-			std::vector<Graph::Edge *> edges(graph->getEdges().begin(), graph->getEdges().end());
-			auto ele = RidgeConverter::ridgeToHeightmap(edges, w + 1);
-			//hmap->setScale(initial3d::vec3d(5, 5, 5));
-			hmap->setHeights(&ele[0], w + 1, w + 1);
-			gecom::log("Editor") << "Heightmap creation finished";
+			// already in progress?
+			if (hmap_future.valid()) return;
+			// convert edges to heightmap on the layout thread; installed by update()
+			auto ele = std::make_shared<std::promise<std::vector<float>>>();
+			hmap_future = ele->get_future();
+			post([=]() {
+				// nothing to do if the graph hasnt changed since the last one (empty result)
+				if (graph->getVersion() == hmap_version && w == hmap_width) {
+					ele->set_value({});
+					return;
+				}
+				gecom::log("Editor") << "Beginning heightmap creation...";
+				hmap_version = graph->getVersion();
+				hmap_width = w;
+				ele->set_value(RidgeConverter::ridgeToHeightmap(graph->getEdges(), w + 1));
+			});
 		}
 
-		void subdivideAndBranch(const std::unordered_set<Graph::Node *> active_nodes) {
+		// layout thread only
+		void subdivideAndBranch(const std::vector<Graph::Node *> &active_nodes) {
 			using namespace std;
 			using namespace initial3d;
 
-			default_random_engine rand;
+			// one draw from the graph's own generator per pass; all other randomness comes from
+			// growthRandom(), so expansion is reproducible and independent of thread count
+			default_random_engine &rand = graph->random();
+			const uint64_t seed = uint64_t(rand()) << 32 ^ rand();
 
-			//uniform_int_distribution<unsigned> bd(0, 1);
+			// how many nodes to split from, and to branch from
+			const size_t k = active_nodes.size() / 15 + 1;
 
 			// make 'old' active nodes heavier, and fix the heaviest
+			const int n_active = int(active_nodes.size());
+#pragma omp parallel for
+			for (int i = 0; i < n_active; i++) {
+				active_nodes[i]->mass *= 1.5f;
+			}
 			for (Graph::Node *n : active_nodes) {
-				n->mass *= 1.5f;
-				if (n->mass > 20.f && n->getEdges().size() > 2) {
+				if (!n->fixed && n->mass > 20.f && n->getEdges().size() > 2) {
 					// only fix nodes with sufficient neighbours
-					n->fixed = true;
+					graph->setFixed(n, true);
 				}
 			}
 
-			// subdivide some edges (elevation is averaged then randomly modified)
-			priority_queue<node_split_ptr> split_q;
-			for (Graph::Node *n : active_nodes) {
-				split_q.push(n);
+			// pick the nodes to split from and branch from
+			vector<node_priority> split_q(active_nodes.size());
+			vector<node_priority> branch_q(active_nodes.size());
+#pragma omp parallel for
+			for (int i = 0; i < n_active; i++) {
+				Graph::Node *n = active_nodes[i];
+				split_q[i] = node_priority(n, n->split_priority());
+				branch_q[i] = node_priority(n, n->branch_priority(growthRandom(seed, n->getID(), 0)));
 			}
-			for (unsigned i = 0; i < active_nodes.size() / 15 + 1; i++) {
-				Graph::Node *n0 = split_q.top().get();
-				split_q.pop();
-				// skip some? idk why
-				//if (bd(rand)) continue;
-				// get highest priority connected node
-				priority_queue<node_split_ptr> q2;
+			selectTop(split_q, k);
+			selectTop(branch_q, k);
+
+			// collect new nodes and edges, then add them all at once
+			Graph::Batch batch(*graph);
+
+			// subdivide some edges (elevation is averaged then randomly modified).
+			// choose edges in priority order so each is only split once, then fill in the new nodes.
+			struct split {
+				Graph::Node *n0, *n1, *n2;
+			};
+			vector<split> splits;
+			splits.reserve(split_q.size());
+			for (const node_priority &p : split_q) {
+				Graph::Node *n0 = p.get();
+				// get highest priority connected node, by an edge not already split
+				Graph::Edge *e1 = nullptr;
+				node_priority p1;
 				for (Graph::Edge *e : n0->getEdges()) {
-					q2.push(e->other(n0));
+					if (batch.isSplit(e)) continue;
+					node_priority p2(e->other(n0), e->other(n0)->split_priority());
+					if (!e1 || p2 < p1) {
+						e1 = e;
+						p1 = p2;
+					}
 				}
-				Graph::Node *n1 = q2.top().get();
-				assert(n1);
-				uniform_real_distribution<float> fd(0, 1);
-				// new node at midpoint
-				Graph::Node *n2 = graph->addNode(float3::mixf(n0->position, n1->position, fd(rand)));
+				if (!e1) continue;
+				Graph::Node *n2 = batch.addNode(n0->position);
+				batch.splitEdge(e1, n2);
+				splits.push_back({ n0, p1.get(), n2 });
+			}
+			const int n_splits = int(splits.size());
+#pragma omp parallel for
+			for (int i = 0; i < n_splits; i++) {
+				Graph::Node *n0 = splits[i].n0, *n1 = splits[i].n1, *n2 = splits[i].n2;
+				// new node somewhere between
+				n2->position = float3::mixf(n0->position, n1->position, growthRandom(seed, n2->getID(), 1));
 				// average elevation
 				n2->elevation = 0.5f * (n0->elevation + n1->elevation);
 				// randomly modify elevation
-				n2->elevation *= 1.f + (fd(rand) - 0.4f);
+				n2->elevation *= 1.f + (growthRandom(seed, n2->getID(), 2) - 0.4f);
 				// average charge
 				n2->charge = 0.5f * (n0->charge + n1->charge);
-				// split the edge
-				graph->deleteEdge(n0->findEdge(n1));
-				graph->addEdge(n0, n2);
-				graph->addEdge(n2, n1);
 				// if starting node was selected, propagate
-				if (n0->selected) graph->select(n2, true);
+				n2->selected = n0->selected;
 			}
 
 			// make some branches (elevation is reduced)
-			priority_queue<node_branch_ptr> branch_q;
-			for (Graph::Node *n : active_nodes) {
-				branch_q.push(n);
-			}
-			//uniform_int_distribution<unsigned> nodes_dist(0, active_nodes.size() - 1);
-			for (unsigned i = 0; i < active_nodes.size() / 15 + 1; i++) {
-				Graph::Node *n0 = branch_q.top().get();
-				branch_q.pop();
-				//Graph::Node *n0 = active_nodes[nodes_dist(rand)]; 
-				// max allowed edges is 4
+			vector<pair<Graph::Node *, Graph::Node *>> branches;
+			branches.reserve(branch_q.size());
+			for (const node_priority &p : branch_q) {
+				Graph::Node *n0 = p.get();
+				// max allowed edges is 4 (splitting doesnt change this)
 				if (n0->getEdges().size() >= 4) continue;
-				// skip some? idk why
-				//if (bd(rand)) continue;
-				uniform_real_distribution<float> pd(-0.01, 0.01);
+				Graph::Node *n2 = batch.addNode(n0->position);
+				batch.addEdge(n0, n2);
+				branches.emplace_back(n0, n2);
+			}
+			const int n_branches = int(branches.size());
+#pragma omp parallel for
+			for (int i = 0; i < n_branches; i++) {
+				Graph::Node *n0 = branches[i].first, *n2 = branches[i].second;
 				// new node at randomly modified position
-				Graph::Node *n2 = graph->addNode(n0->position + float3(pd(rand), pd(rand), 0));
+				float dx = 0.02f * growthRandom(seed, n2->getID(), 3) - 0.01f;
+				float dy = 0.02f * growthRandom(seed, n2->getID(), 4) - 0.01f;
+				n2->position = n0->position + float3(dx, dy, 0);
 				// reduce elevation
 				n2->elevation = n0->elevation * 0.9f;
 				// reduce charge
 				n2->charge = n0->charge * 0.9f;
-				// create edge
-				graph->addEdge(n0, n2);
 				// if starting node was selected, propagate
-				if (n0->selected) graph->select(n2, true);
+				n2->selected = n0->selected;
 			}
 
+			batch.commit();
+		}
 
+		// counter-based random number in [0, 1). the same seed, node id and counter always
+		// give the same number, whichever thread asks and in whatever order.
+		static float growthRandom(uint64_t seed, unsigned id, unsigned counter) {
+			// splitmix64 finalizer
+			uint64_t x = seed ^ (uint64_t(id) << 32 | counter);
+			x += 0x9E3779B97F4A7C15ull;
+			x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+			x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+			x ^= x >> 31;
+			return float(x >> 40) * (1.f / 16777216.f);
 		}
 
-		bool doLayout(const std::unordered_set<Graph::Node *> &active_nodes) {
+		// layout thread only.
+		// returns true if layout stopped before using all its steps.
+		bool doLayout(const std::vector<Graph::Node *> &active_nodes) {
+			using namespace std::chrono;
 			// set active node count
 			active_node_count = 0;
 			for (Graph::Node *n : active_nodes) {
 				active_node_count += !n->fixed;
 			}
-			// rough complexity estimate
-			float complexity = active_node_count * log(graph->getNodes().size());
-			int steps0 = 30000.f / complexity + 2.f;
-			// TODO account for cost of tree building
+			// size batches to take a few ms, so edits and snapshots aren't held up
+			const int steps0 = layout_batch;
+			auto time0 = steady_clock::now();
 			int steps1 = graph->doLayout(steps0, active_nodes);
+			double t = duration<double>(steady_clock::now() - time0).count();
+			if (steps1 == steps0) {
+				layout_batch = std::max(1, std::min(10000, int(steps0 * std::min(2.0, 0.005 / std::max(t, 1e-6)))));
+			}
 			// accumulate total steps
 			step_count += steps1;
 			return steps1 < steps0;
 		}
 
+		// layout thread only
 		bool doLayout() {
 			if (graph->getSelectedNodes().empty()) {
 				// nothing selected, layout all
@@ -779,6 +912,15 @@ namespace skadi {
 			}
 		}
 
+		// layout thread only
+		int doMultilevelLayout() {
+			const std::vector<Graph::Node *> &active_nodes = graph->getSelectedNodes().empty() ? graph->getNodes() : graph->getSelectedNodes();
+			int steps = graph->doMultilevelLayout(2000, active_nodes);
+			step_count += steps;
+			return steps;
+		}
+
+		// layout thread only
 		void subdivideAndBranch() {
 			if (graph->getSelectedNodes().empty()) {
 				// nothing selected, expand all
@@ -790,15 +932,18 @@ namespace skadi {
 		}
 
 		int getActiveNodeCount() {
-			return active_node_count;
+			return snapshot().active_node_count;
+		}
+
+		int getNodeCount() {
+			return snapshot().node_count;
 		}
 
 		int pollStepCount() {
-			int r = step_count;
-			step_count = 0;
-			return r;
+			return step_count.exchange(0);
 		}
 
+		// layout thread only
 		Graph * getGraph() { return graph; }
 
 		Heightmap * getHeightmap() {
@@ -855,8 +1000,24 @@ namespace skadi {
 		GLuint vao_edge;
 		GLuint vbo_node_pos;
 		GLuint ibo_edge_idx;
-		GLuint shdr_node;
-		GLuint shdr_edge;
+
+		// node, edge and box programs
+		struct graph_uniforms {
+			uniform<initial3d::mat4f> modelViewMatrix;
+			uniform<initial3d::mat4f> projectionMatrix;
+			// edges only
+			uniform<float> elevationMax;
+
+			explicit graph_uniforms(GLuint prog) :
+				modelViewMatrix(prog, "modelViewMatrix"),
+				projectionMatrix(prog, "projectionMatrix"),
+				elevationMax(prog, "elevationMax")
+			{ }
+		};
+
+		shader_program<graph_uniforms> shdr_node;
+		shader_program<graph_uniforms> shdr_edge;
+		shader_program<graph_uniforms> shdr_box;
 
 		// Brush
 		//
@@ -864,24 +1025,277 @@ namespace skadi {
 		float brush_radius;
 		initial3d::vec3f brush_position;
 
-		GLuint shdr_brush;
+		struct brush_uniforms {
+			uniform<float, 2> pos;
+			uniform<float> radius;
+			uniform<initial3d::mat4f> proj_matrix;
+			uniform<float> time;
+
+			explicit brush_uniforms(GLuint prog) :
+				pos(prog, "pos"),
+				radius(prog, "radius"),
+				proj_matrix(prog, "proj_matrix"),
+				time(prog, "time")
+			{ }
+		};
+
+		shader_program<brush_uniforms> shdr_brush;
 		GLuint vao_brush;
 		GLuint vbo_brush_angles;
+		static const int brush_vertex_count = 1000;
 
 		GLuint fbo_graph;
 		GLuint tex_graph;
 
 		static const int graph_tex_width = 2048;
+		static const int graph_tex_tile = 128;
+
+		// graph version (and max elevation) last drawn to the graph texture
+		unsigned long long tex_graph_version = no_version;
+		float tex_graph_elevation_max = 0;
 
 		Heightmap *hmap;
 
 		bool should_make_hmap = false;
+		std::future<std::vector<float>> hmap_future;
+		// layout thread: graph version and size of the last heightmap
+		unsigned long long hmap_version = -1;
+		int hmap_width = 0;
+
+		// brush stroke in progress
+		Brush *stroke_brush = nullptr;
+		int stroke_button = -1;
+
+		// layout thread and edits waiting for it
+		std::thread layout_thread;
+		gecom::blocking_queue<std::function<void()>> layout_commands;
+		int layout_threads = 1;
+		int layout_batch = 10;
+		bool layout_quit = false;
 		bool should_do_layout = false;
 		bool should_expand_graph = false;
 
+		// file for F5 (save) and F9 (load)
+		std::string graph_path = "graph.skadi";
+
 		// layout stats
 		int active_node_count = 0;
-		int step_count;
+		std::atomic<int> step_count { 0 };
+
+		// graph drawing data, made by the layout thread
+		struct graph_snapshot {
+			// x, y, elevation, flags per node
+			std::vector<float> node_data;
+			std::vector<GLuint> edge_idx;
+			float elevation_max = 0.01f;
+			int active_node_count = 0;
+			int node_count = 0;
+			// graph version, and what changed since the previous snapshot.
+			// if changed_known is false, treat everything as changed.
+			unsigned long long version = -1;
+			unsigned long long prev_version = -1;
+			std::vector<Graph::Region> changed;
+			bool changed_known = false;
+			// node index ranges [begin, end) and whether edges changed, since the previous snapshot
+			std::vector<std::pair<size_t, size_t>> node_ranges;
+			bool edges_changed = false;
+		};
+
+		// version value meaning 'nothing yet'
+		static const unsigned long long no_version = -1;
+
+		// layout thread: last published graph drawing data
+		unsigned long long published_version = no_version;
+		std::vector<float> published_nodes;
+		std::vector<GLuint> published_edges;
+		float published_elevation_max = 0.01f;
+
+		// render thread: graph version in the gpu buffers, and buffer sizes in bytes
+		unsigned long long gpu_version = no_version;
+		size_t gpu_node_capacity = 0;
+		size_t gpu_edge_capacity = 0;
+
+		gecom::triple_buffer<graph_snapshot> snapshots;
+
+		// render thread: latest published snapshot
+		const graph_snapshot & snapshot() {
+			snapshots.update();
+			return snapshots.front();
+		}
+
+		void draw_graph(const initial3d::mat4f &view_mat, const initial3d::mat4f &proj_mat, const graph_snapshot &snap) {
+
+			using namespace std;
+			using namespace initial3d;
+
+			
+
+			// mat4d view_matrix = !camera->getViewTransform();
+
+			const vector<float> &nodePos = snap.node_data;
+			const vector<GLuint> &edgeIdx = snap.edge_idx;
+			uploadGraph(snap);
+
+			//Actual Draw Calls
+			//
+			const graph_uniforms &un = shdr_node.use();
+			un.modelViewMatrix.set(view_mat);
+			un.projectionMatrix.set(proj_mat);
+
+			glBindVertexArray(vao_node);
+			glDrawArrays(GL_POINTS, 0, nodePos.size() / 4);
+
+
+			const graph_uniforms &ue = shdr_edge.use();
+			ue.modelViewMatrix.set(view_mat);
+			ue.projectionMatrix.set(proj_mat);
+			ue.elevationMax.set(snap.elevation_max);
+
+			glBindVertexArray(vao_edge);
+			glDrawElements(GL_LINES, edgeIdx.size(), GL_UNSIGNED_INT, nullptr);
+		}
+
+		// render thread: bring the gpu copy of the graph up to date.
+		// nothing is uploaded if the graph hasnt changed; if this follows on from the previous
+		// snapshot, only changed nodes are uploaded, otherwise everything is.
+		void uploadGraph(const graph_snapshot &snap) {
+			if (snap.version == gpu_version) return;
+			const bool incremental = gpu_version != no_version && snap.prev_version == gpu_version;
+
+			glBindBuffer(GL_ARRAY_BUFFER, vbo_node_pos);
+			const size_t node_bytes = snap.node_data.size() * sizeof(float);
+			if (!incremental || node_bytes > gpu_node_capacity) {
+				uploadBuffer(GL_ARRAY_BUFFER, gpu_node_capacity, snap.node_data.data(), node_bytes);
+			} else {
+				for (const auto &r : snap.node_ranges) {
+					glBufferSubData(GL_ARRAY_BUFFER, 16 * r.first, 16 * (r.second - r.first), &snap.node_data[4 * r.first]);
+				}
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			if (!incremental || snap.edges_changed) {
+				// element buffer binding belongs to the vao
+				glBindVertexArray(vao_edge);
+				uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu_edge_capacity, snap.edge_idx.data(), snap.edge_idx.size() * sizeof(GLuint));
+				glBindVertexArray(0);
+			}
+
+			gpu_version = snap.version;
+		}
+
+		// replace the whole contents of the bound buffer, growing it if needed.
+		// reallocating at the same size orphans the old storage, so the driver doesnt have
+		// to wait for draws that are still using it.
+		static void uploadBuffer(GLenum target, size_t &capacity, const void *data, size_t bytes) {
+			if (bytes > capacity) capacity = std::max(bytes, capacity * 2);
+			glBufferData(target, std::max<size_t>(capacity, 16), nullptr, GL_DYNAMIC_DRAW);
+			if (bytes) glBufferSubData(target, 0, bytes, data);
+		}
+
+		// layout thread: copy out what is needed to draw the graph
+		void publishSnapshot() {
+			using namespace initial3d;
+
+			graph_snapshot &snap = snapshots.back();
+			// this buffer was last filled a few snapshots ago
+			const bool stale = snap.version != graph->getVersion();
+
+			snap.changed.clear();
+			snap.node_ranges.clear();
+			snap.edges_changed = false;
+
+			snap.prev_version = published_version;
+			snap.version = graph->getVersion();
+			snap.changed_known = published_version != no_version && graph->getChangedRegions(published_version, snap.changed);
+
+			if (snap.version != published_version) {
+				// bring the last published copy up to date, noting which nodes changed
+				const std::vector<Graph::Node *> &nodes = graph->getNodes();
+				const size_t old_count = published_nodes.size() / 4;
+				published_nodes.resize(nodes.size() * 4);
+				// prevent divide by 0
+				published_elevation_max = 0.01f;
+				// nodes are dense, so a node's index is its vertex index
+				for (size_t i = 0; i < nodes.size(); i++) {
+					Graph::Node *node = nodes[i];
+					vec3f pos = node->position;
+					published_elevation_max = std::max(published_elevation_max, node->elevation);
+					// bithacks - flags as bits in a float
+					GLuint flags = 0;
+					flags |= GLuint(node->selected) << 0;
+					flags |= GLuint(node->fixed) << 1;
+					float d[4] = { pos.x(), pos.y(), node->elevation, reinterpret_cast<float &>(flags) };
+					float *p = &published_nodes[4 * i];
+					if (i >= old_count || std::memcmp(p, d, sizeof(d)) != 0) {
+						std::memcpy(p, d, sizeof(d));
+						// join nearby changes, so there are fewer uploads
+						if (!snap.node_ranges.empty() && i - snap.node_ranges.back().second < 64) {
+							snap.node_ranges.back().second = i + 1;
+						} else {
+							snap.node_ranges.emplace_back(i, i + 1);
+						}
+					}
+				}
+
+				const std::vector<Graph::Edge *> &edges = graph->getEdges();
+				snap.edges_changed = published_edges.size() != edges.size() * 2;
+				published_edges.resize(edges.size() * 2);
+				for (size_t i = 0; i < edges.size(); i++) {
+					GLuint i1 = edges[i]->getNode1()->getIndex();
+					GLuint i2 = edges[i]->getNode2()->getIndex();
+					if (published_edges[2 * i] != i1 || published_edges[2 * i + 1] != i2) {
+						published_edges[2 * i] = i1;
+						published_edges[2 * i + 1] = i2;
+						snap.edges_changed = true;
+					}
+				}
+			}
+
+			if (stale) {
+				snap.node_data = published_nodes;
+				snap.edge_idx = published_edges;
+				snap.elevation_max = published_elevation_max;
+			}
+
+			published_version = snap.version;
+			snap.active_node_count = active_node_count;
+			snap.node_count = graph->getNodes().size();
+
+			snapshots.publish();
+		}
+
+		void layoutMain() {
+			omp_set_num_threads(layout_threads);
+			gecom::log("Editor") << "Layout thread started";
+			// true when layout has stopped and there is nothing else to do
+			bool settled = false;
+			while (!layout_quit) {
+				std::function<void()> cmd;
+				if (settled || !should_do_layout) {
+					// wait for something to change
+					cmd = layout_commands.pop();
+					cmd();
+					settled = false;
+				}
+				// run all pending edits
+				while (layout_commands.pop(cmd)) {
+					cmd();
+				}
+				if (should_do_layout && !layout_quit) {
+					if (doLayout()) {
+						// not while an edit (a brush stroke) is open, or undoing it would undo expansion too;
+						// the edit ends with a command, which wakes this up again
+						if (should_expand_graph && !graph->isEditing()) {
+							subdivideAndBranch();
+						} else {
+							settled = true;
+						}
+					}
+				}
+				publishSnapshot();
+			}
+			gecom::log("Editor") << "Layout thread finished";
+		}
 
 		class node_ptr {
 		private:
@@ -911,29 +1325,28 @@ namespace skadi {
 			}
 		};
 
-		class node_split_ptr : public node_ptr {
+		// a node with a priority for splitting or branching
+		class node_priority : public node_ptr {
 		private:
 			float m_x;
 
 		public:
-			node_split_ptr(Graph::Node *n) : node_ptr(n), m_x(n->split_priority()) { }
+			node_priority(Graph::Node *n = nullptr, float x = 0) : node_ptr(n), m_x(x) { }
 
-			bool operator<(const node_split_ptr &n) const {
-				return m_x < n.m_x;
+			// sorts highest priority first; ties go to the lowest id
+			bool operator<(const node_priority &n) const {
+				return m_x > n.m_x || (m_x == n.m_x && (*this)->getID() < n->getID());
 			}
 		};
 
-		class node_branch_ptr : public node_ptr {
-		private:
-			float m_x;
-
-		public:
-			node_branch_ptr(Graph::Node *n) : node_ptr(n), m_x(n->branch_priority()) { }
-
-			bool operator<(const node_branch_ptr &n) const {
-				return m_x < n.m_x;
-			}
-		};
+		// sort the k highest priority nodes to the front and drop the rest,
+		// without sorting everything
+		static void selectTop(std::vector<node_priority> &q, size_t k) {
+			k = std::min(k, q.size());
+			std::nth_element(q.begin(), q.begin() + k, q.end());
+			q.resize(k);
+			std::sort(q.begin(), q.end());
+		}
 
 
 	};
@@ -0,0 +1,208 @@
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "GraphFile.hpp"
+
+using namespace std;
+using namespace initial3d;
+
+namespace {
+
+	const char file_magic[8] = { 'S', 'K', 'A', 'D', 'I', 'G', 'R', '\0' };
+
+	size_t align16(size_t x) {
+		return (x + 15) & ~size_t(15);
+	}
+
+	// read-only memory mapping of a whole file
+	class mapped_file {
+	private:
+		const char *m_data = nullptr;
+		size_t m_size = 0;
+#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = nullptr;
+#endif
+
+	public:
+		explicit mapped_file(const string &path) {
+#ifdef _WIN32
+			m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (m_file == INVALID_HANDLE_VALUE) throw skadi::graph_file_error("failed to open file " + path);
+			LARGE_INTEGER size;
+			GetFileSizeEx(m_file, &size);
+			m_size = size_t(size.QuadPart);
+			if (m_size) {
+				m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (m_mapping) m_data = reinterpret_cast<const char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+				if (!m_data) {
+					close();
+					throw skadi::graph_file_error("failed to map file " + path);
+				}
+			}
+#else
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw skadi::graph_file_error("failed to open file " + path);
+			struct stat st;
+			if (fstat(fd, &st) == 0) m_size = size_t(st.st_size);
+			if (m_size) {
+				void *p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (p != MAP_FAILED) {
+					m_data = reinterpret_cast<const char *>(p);
+					// records are read front to back, once
+					madvise(p, m_size, MADV_SEQUENTIAL);
+				}
+			}
+			::close(fd);
+			if (m_size && !m_data) throw skadi::graph_file_error("failed to map file " + path);
+#endif
+		}
+
+		mapped_file(const mapped_file &) = delete;
+		mapped_file & operator=(const mapped_file &) = delete;
+
+		const char * data() const {
+			return m_data;
+		}
+
+		size_t size() const {
+			return m_size;
+		}
+
+		void close() {
+#ifdef _WIN32
+			if (m_data) UnmapViewOfFile(m_data);
+			if (m_mapping) CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+			m_mapping = nullptr;
+			m_file = INVALID_HANDLE_VALUE;
+#else
+			if (m_data) munmap(const_cast<char *>(m_data), m_size);
+#endif
+			m_data = nullptr;
+			m_size = 0;
+		}
+
+		~mapped_file() {
+			close();
+		}
+	};
+
+}
+
+namespace skadi {
+
+	void GraphFile::save(const Graph &g, const string &path) {
+
+		// write nodes in id order, so a loaded graph lays out the same way
+		const vector<Graph::Node *> nodes = Graph::sortByID(g.getNodes());
+
+		// node index -> record index
+		vector<uint32_t> record(nodes.size());
+		for (size_t i = 0; i < nodes.size(); i++) {
+			record[nodes[i]->getIndex()] = uint32_t(i);
+		}
+
+		header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, file_magic, sizeof(h.magic));
+		h.version = version;
+		h.byte_order = byte_order_mark;
+		h.header_size = sizeof(header);
+		h.node_count = nodes.size();
+		h.edge_count = g.getEdges().size();
+		h.node_stride = sizeof(node_record);
+		h.edge_stride = sizeof(edge_record);
+		h.node_offset = align16(sizeof(header));
+		h.edge_offset = align16(h.node_offset + h.node_count * h.node_stride);
+
+		vector<char> buf(align16(h.edge_offset + h.edge_count * h.edge_stride), 0);
+		memcpy(buf.data(), &h, sizeof(h));
+
+		node_record *nr = reinterpret_cast<node_record *>(buf.data() + h.node_offset);
+		for (Graph::Node *n : nodes) {
+			nr->x = n->position.x();
+			nr->y = n->position.y();
+			nr->elevation = n->elevation;
+			nr->sharpness = n->sharpness;
+			nr->mass = n->mass;
+			nr->charge = n->charge;
+			nr->flags = (n->selected ? flag_selected : 0) | (n->fixed ? flag_fixed : 0);
+			nr++;
+		}
+
+		// edges in id order too, so each node gets its edges back in the same order
+		edge_record *er = reinterpret_cast<edge_record *>(buf.data() + h.edge_offset);
+		for (Graph::Edge *e : Graph::sortByID(g.getEdges())) {
+			er->node1 = record[e->node1->getIndex()];
+			er->node2 = record[e->node2->getIndex()];
+			er->spring = e->spring;
+			er++;
+		}
+
+		ofstream file(path, ios::out | ios::binary | ios::trunc);
+		if (!file.good()) throw graph_file_error("failed to open file " + path);
+		file.write(buf.data(), buf.size());
+		if (!file.good()) throw graph_file_error("failed to write file " + path);
+	}
+
+	void GraphFile::load(const string &path, Graph &g) {
+
+		mapped_file f(path);
+		const char *data = f.data();
+
+		// check everything before touching the graph
+		header h;
+		if (f.size() < sizeof(header)) throw graph_file_error("not a graph file: " + path);
+		memcpy(&h, data, sizeof(h));
+		if (memcmp(h.magic, file_magic, sizeof(h.magic)) != 0) throw graph_file_error("not a graph file: " + path);
+		if (h.byte_order != byte_order_mark) throw graph_file_error("graph file has a different byte order: " + path);
+		if (h.version != version) throw graph_file_error("unsupported graph file version " + to_string(h.version) + ": " + path);
+		if (h.header_size < sizeof(header) || h.header_size > h.node_offset || h.header_size > h.edge_offset) throw graph_file_error("bad header size: " + path);
+		if (h.node_stride < sizeof(node_record) || h.edge_stride < sizeof(edge_record)) throw graph_file_error("bad record size: " + path);
+		if (h.node_count > 0xFFFFFFFFull || h.edge_count > 0xFFFFFFFFull) throw graph_file_error("too many records: " + path);
+		if (h.node_offset > f.size() || h.node_count * h.node_stride > f.size() - h.node_offset) throw graph_file_error("truncated node records: " + path);
+		if (h.edge_offset > f.size() || h.edge_count * h.edge_stride > f.size() - h.edge_offset) throw graph_file_error("truncated edge records: " + path);
+
+		for (uint64_t i = 0; i < h.edge_count; i++) {
+			edge_record er;
+			memcpy(&er, data + h.edge_offset + i * h.edge_stride, sizeof(er));
+			if (er.node1 >= h.node_count || er.node2 >= h.node_count) throw graph_file_error("bad edge record: " + path);
+		}
+
+		g.clear();
+		g.reserve(h.node_count, h.edge_count);
+
+		vector<Graph::Node *> nodes(h.node_count);
+		for (uint64_t i = 0; i < h.node_count; i++) {
+			node_record nr;
+			memcpy(&nr, data + h.node_offset + i * h.node_stride, sizeof(nr));
+			Graph::Node *n = g.addNode(vec3f(nr.x, nr.y, 0), nr.elevation, nr.sharpness);
+			n->mass = nr.mass;
+			n->charge = nr.charge;
+			if (nr.flags & flag_fixed) g.setFixed(n, true);
+			if (nr.flags & flag_selected) g.select(n, true);
+			nodes[i] = n;
+		}
+
+		for (uint64_t i = 0; i < h.edge_count; i++) {
+			edge_record er;
+			memcpy(&er, data + h.edge_offset + i * h.edge_stride, sizeof(er));
+			Graph::Edge *e = g.addEdge(nodes[er.node1], nodes[er.node2]);
+			e->spring = er.spring;
+		}
+	}
+
+}
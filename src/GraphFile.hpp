@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+
+#include "Graph.hpp"
+
+namespace skadi {
+
+	class graph_file_error : public std::runtime_error {
+	public:
+		explicit graph_file_error(const std::string &what_ = "Graph file error.") : std::runtime_error(what_) { }
+	};
+
+	// Binary graph files.
+	//
+	// Layout (native byte order, marked in the header), all sections 16-byte aligned:
+	//   header
+	//   node records, in node id order
+	//   edge records, in edge id order, referring to nodes by record index
+	//
+	// Records are fixed size and flat, so the file can be mapped and read in one pass.
+	// Readers use the record strides and section offsets from the header, so a record or
+	// the header can grow at the end without moving anything. There is no minor version
+	// yet: the version must match exactly, and any change to the format bumps it.
+	// Files from a machine of the other byte order are rejected rather than swapped.
+	class GraphFile {
+	public:
+		static const uint32_t version = 1;
+
+		// written in native order; reads back byte-swapped on the other byte order
+		static const uint32_t byte_order_mark = 0x01020304;
+
+		struct header {
+			char magic[8];
+			uint32_t version;
+			uint32_t header_size;
+			uint64_t node_count;
+			uint64_t edge_count;
+			uint64_t node_offset;
+			uint64_t edge_offset;
+			uint32_t node_stride;
+			uint32_t edge_stride;
+			uint32_t byte_order;
+			uint32_t reserved;
+		};
+
+		struct node_record {
+			float x, y;
+			float elevation;
+			float sharpness;
+			float mass;
+			float charge;
+			uint32_t flags;
+			uint32_t reserved;
+		};
+
+		struct edge_record {
+			uint32_t node1;
+			uint32_t node2;
+			float spring;
+		};
+
+		// node record flags
+		static const uint32_t flag_selected = 0x1;
+		static const uint32_t flag_fixed = 0x2;
+
+		// write a graph to a file; throws graph_file_error on failure
+		static void save(const Graph &g, const std::string &path);
+
+		// replace the contents of a graph with the contents of a file.
+		// throws graph_file_error on failure, in which case the graph is unchanged.
+		static void load(const std::string &path, Graph &g);
+	};
+
+}
@@ -7,8 +7,17 @@
 */
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
 #include <vector>
 
+#include "Concurrent.hpp"
+#include "HeightmapNormals.hpp"
 #include "Image.hpp"
 #include "Initial3D.hpp"
 #include "SimpleShader.hpp"
@@ -20,100 +29,70 @@ namespace skadi {
 
 	class Heightmap {
 	public:
+		// how the terrain is drawn
+		enum class Mode {
+			// one grid, of the size given to the constructor
+			mesh,
+			// the same grid, drawn as instances of one shared patch; no per-vertex buffers
+			instanced,
+			// quadtree of grid patches, finer near the camera and culled to the view (CDLOD).
+			// detail follows the height texture, not the mesh size.
+			cdlod,
+			// coarse grid of patches culled to the view, subdivided on the gpu until the heights are
+			// within some screen space error. needs tessellation shaders (GL 4.0); draws as cdlod without.
+			tessellated
+		};
+
+		// index format of the shared patch (instanced and cdlod modes)
+		enum class Indices {
+			// 16-bit triangle list
+			triangles,
+			// 16-bit triangle strips, one per row, with primitive restart
+			strips
+		};
+
+		// height texture storage. the 16-bit formats hold heights scaled to the range of the map.
+		enum class HeightFormat {
+			r32f,
+			r16f,
+			r16
+		};
+
+		// normal texture storage. the two-channel formats are octahedral, using only the upper half
+		// of the octahedron as terrain normals always point up.
+		enum class NormalFormat {
+			rgba16f,
+			rg16f,
+			rg8_snorm
+		};
+
 		// width and height are number of EDGES, not VERTICES
 		Heightmap(int width, int height) : m_width(width), m_height(height) {
-			glGenVertexArrays(1, &vao);
-			glGenBuffers(1, &ibo);
-			glGenBuffers(1, &vbo_pos);
-			glGenBuffers(1, &vbo_uv);
-			genMesh(width, height);
+			genPatch();
 
 			float f = 0.f;
 			setHeights(&f, 1, 1);
 
 		}
 
-		// width and height are number of EDGES, not VERTICES
+		// width and height are number of EDGES, not VERTICES.
+		// the full mesh buffers are only built if that mode is drawn.
 		void genMesh(int width, int height) {
-
 			m_width = width;
 			m_height = height;
-
-			std::vector<GLuint> idx;
-			std::vector<float> pos;
-			std::vector<float> uv;
-
-			for (int y = 0; y <= height; y++) {
-				for (int x = 0; x <= width; x++) {
-					pos.push_back(2 * x / float(width) - 1);
-					pos.push_back(0);
-					pos.push_back(2 * y / float(height) - 1);
-					// 
-					uv.push_back((x + 0.5) / float(width + 1));
-					uv.push_back((y + 0.5) / float(height + 1));
-				}
-			}
-
-			auto get_index = [&](int x, int y) -> unsigned {
-				// reserve index 0 for 'not a vertex'
-				// i dont think ^^^ is what this does anymore...
-				if (x < 0 || x > width) return 0;
-				if (y < 0 || y > height) return 0;
-				return unsigned(width + 1) * unsigned(y) + unsigned(x);
-			};
-
-			for (int y = 0; y < height; y++) {
-				for (int x = 0; x < width; x++) {
-
-					// 1---3 //
-					// | /   //
-					// 2     //
-					idx.push_back(get_index(  x  ,   y  ));
-					idx.push_back(get_index(  x  , y + 1));
-					idx.push_back(get_index(x + 1,   y  ));
-
-					//     2 //
-					//   / | //
-					// 3---1 //
-					idx.push_back(get_index(x + 1, y + 1));
-					idx.push_back(get_index(x + 1,   y  ));
-					idx.push_back(get_index(  x  , y + 1));
-				}
-			}
-
-
-			glBindVertexArray(vao);
-
-			// upload indices
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo); // this sticks to the vao
-			glBufferData(GL_ELEMENT_ARRAY_BUFFER, idx.size() * sizeof(GLuint), &idx[0], GL_DYNAMIC_DRAW);
-
-			// upload positions
-			glBindBuffer(GL_ARRAY_BUFFER, vbo_pos);
-			glBufferData(GL_ARRAY_BUFFER, pos.size() * sizeof(float), &pos[0], GL_DYNAMIC_DRAW);
-			glEnableVertexAttribArray(0);
-			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
-
-			// upload texture coord
-			glBindBuffer(GL_ARRAY_BUFFER, vbo_uv);
-			glBufferData(GL_ARRAY_BUFFER, uv.size() * sizeof(float), &uv[0], GL_DYNAMIC_DRAW);
-			glEnableVertexAttribArray(1);
-			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
-
-			// cleanup
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
-
+			m_mesh_valid = false;
 		}
 
 		void updateNormals() {
+			updateNormals(0, 0, m_tex_width, m_tex_height);
+		}
+
+		// recompute normals for a rectangle of texels (clipped to the map)
+		void updateNormals(int x, int y, int rw, int rh) {
 
 			assert(tex_height);
 
 			if (!fbo) glGenFramebuffers(1, &fbo);
-			
-			if (tex_norm) glDeleteTextures(1, &tex_norm);
-
-			glGenTextures(1, &tex_norm);
 
 			glActiveTexture(GL_TEXTURE0);
 			glBindTexture(GL_TEXTURE_2D, tex_height);
@@ -123,23 +102,85 @@ namespace skadi {
 			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &w);
 			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h);
 
-			glBindTexture(GL_TEXTURE_2D, tex_norm);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+			// keep the normal map if its size and format havent changed
+			if (!tex_norm || w != m_norm_width || h != m_norm_height || m_normal_format != m_norm_format) {
+				if (tex_norm) glDeleteTextures(1, &tex_norm);
+				glGenTextures(1, &tex_norm);
+				glBindTexture(GL_TEXTURE_2D, tex_norm);
+				switch (m_normal_format) {
+				case NormalFormat::rg16f:
+					glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, w, h, 0, GL_RG, GL_FLOAT, nullptr);
+					break;
+				case NormalFormat::rg8_snorm:
+					glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8_SNORM, w, h, 0, GL_RG, GL_FLOAT, nullptr);
+					break;
+				default:
+					glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+				}
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+				m_norm_width = w;
+				m_norm_height = h;
+				m_norm_format = m_normal_format;
+				// new storage, so all of it
+				x = 0;
+				y = 0;
+				rw = w;
+				rh = h;
+			}
 
-			glBindTexture(GL_TEXTURE_2D, tex_height);
+			rw = std::min(x + rw, int(w)) - std::max(x, 0);
+			rh = std::min(y + rh, int(h)) - std::max(y, 0);
+			x = std::max(x, 0);
+			y = std::max(y, 0);
+			if (rw <= 0 || rh <= 0) return;
+
+			const bool oct = m_norm_format != NormalFormat::rgba16f;
+
+			bool cpu = m_cpu_normals;
+			if (!cpu) {
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+				glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex_norm, 0);
+				glDrawBuffer(GL_COLOR_ATTACHMENT0);
+				// snorm formats arent required to be renderable
+				if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+					glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+					cpu = true;
+				}
+			}
+
+			if (cpu) {
+				std::vector<float> normals(3 * size_t(rw) * rh);
+				HeightmapNormals::compute(m_heights.data(), w, h, x, y, rw, rh, normals.data());
+				glBindTexture(GL_TEXTURE_2D, tex_norm);
+				if (oct) {
+					// xyz to octahedral xz, in place
+					for (size_t i = 0; i < size_t(rw) * rh; i++) {
+						const float *n = &normals[3 * i];
+						const float l = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+						const float u = n[0] / l, v = n[2] / l;
+						normals[2 * i] = u;
+						normals[2 * i + 1] = v;
+					}
+					glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, rw, rh, GL_RG, GL_FLOAT, normals.data());
+				} else {
+					glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, rw, rh, GL_RGB, GL_FLOAT, normals.data());
+				}
+				return;
+			}
 
-			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
-			glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex_norm, 0);
-			glDrawBuffer(GL_COLOR_ATTACHMENT0);
+			glBindTexture(GL_TEXTURE_2D, tex_height);
 
 			static const char *prog_src = R"delim(
 			
 			uniform sampler2D sampler_heightmap;
+			// texture to model space height: scale, offset
+			uniform vec2 height_decode;
+			// write octahedral normals
+			uniform bool normal_oct;
 
 			#ifdef _VERTEX_
 
@@ -170,7 +211,7 @@ namespace skadi {
 				ivec2 ts = textureSize(sampler_heightmap, 0);
 				// texelFetch() is undefined when out of bounds - clamp to edges
 				tx = clamp(tx, ivec2(0), ts - 1);
-				float h = texelFetch(sampler_heightmap, tx, 0).r;
+				float h = texelFetch(sampler_heightmap, tx, 0).r * height_decode.x + height_decode.y;
 				return vec3(vec2(tx) / (vec2(ts) - 1.0) * 2.0 - 1.0, h).xzy;
 			}
 
@@ -178,33 +219,43 @@ namespace skadi {
 				vec3 p0 = positionFromTexel(tx);
 				vec3 n = vec3(0.0);
 				const ivec2[] dp = ivec2[](ivec2(1, 0), ivec2(0, -1), ivec2(-1, 0), ivec2(0, 1));
+				ivec2 ts = textureSize(sampler_heightmap, 0);
 				for (int i = 0; i < 4; i++) {
+					// edge texels are missing some neighbours (and clamping would make degenerate triangles)
+					ivec2 a = tx + dp[i], b = tx + dp[(i + 1) % 4];
+					if (any(lessThan(min(a, b), ivec2(0))) || any(greaterThanEqual(max(a, b), ts))) continue;
 					n += normalize(cross(normalize(positionFromTexel(tx + dp[i]) - p0), normalize(positionFromTexel(tx + dp[(i + 1) % 4]) - p0)));
 				}
-				return normalize(n);
+				// no neighbours at all for a single texel
+				return length(n) > 0.0 ? normalize(n) : vec3(0.0, 1.0, 0.0);
 			}
 			
 			out vec4 frag_color;
 			
 			void main() {
-				frag_color = vec4(normalFromTexel(ivec2(gl_FragCoord.xy)), 0.0);
+				vec3 n = normalFromTexel(ivec2(gl_FragCoord.xy));
+				frag_color = normal_oct ? vec4(n.xz / (abs(n.x) + abs(n.y) + abs(n.z)), 0.0, 0.0) : vec4(n, 0.0);
 			}
 
 			#endif
 
 			)delim";
 
-			static GLuint prog = 0;
-			
-			if (!prog) prog = makeShaderProgram("330 core", { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER }, prog_src);
+			if (!m_prog_normals) {
+				m_prog_normals = shader_program<normal_uniforms>("330 core", { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER }, prog_src, { { "sampler_heightmap", 0 } });
+			}
 
 			glViewport(0, 0, w, h);
 
-			glUseProgram(prog);
-
-			glUniform1i(glGetUniformLocation(prog, "sampler_heightmap"), 0);
+			const normal_uniforms &u = m_prog_normals.use();
+			u.height_decode.set(m_height_scale, m_height_offset);
+			u.normal_oct.set(oct);
 
+			// fragment coords are texel coords, so only draw the rectangle
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(x, y, rw, rh);
 			gecom::draw_dummy();
+			glDisable(GL_SCISSOR_TEST);
 
 			glUseProgram(0);
 
@@ -214,42 +265,207 @@ namespace skadi {
 
 		void setHeights(float *heights, int width, int height) {
 
-			if (tex_height) glDeleteTextures(1, &tex_height);
+			discardUploads();
+			m_heights.assign(heights, heights + width * height);
+			m_tex_width = width;
+			m_tex_height = height;
+			m_tree.build(m_heights.data(), m_tex_width, m_tex_height);
+
+			const GLenum format = heightInternalFormat(m_height_storage);
+			heightRange(format, m_tree, m_height_scale, m_height_offset);
+			allocHeights(width, height, format);
+			uploadHeights(0, 0, width, height, heights);
+
+			updateNormals();
+		}
+
+		// replace a rectangle of heights (w * h, row major), which must lie within the map.
+		// only that rectangle is uploaded, and only the normals and bounds around it are updated.
+		void updateRegion(int x, int y, int w, int h, const float *data) {
+			assert(x >= 0 && y >= 0 && x + w <= m_tex_width && y + h <= m_tex_height);
+			if (w <= 0 || h <= 0) return;
+
+			discardUploads();
+			for (int j = 0; j < h; j++) {
+				std::copy(data + size_t(w) * j, data + size_t(w) * (j + 1), m_heights.begin() + size_t(m_tex_width) * (y + j) + x);
+			}
+			m_tree.update(m_heights.data(), m_tex_width, m_tex_height, x, y, w, h);
 
-			glGenTextures(1, &tex_height);
 			glActiveTexture(GL_TEXTURE0);
 			glBindTexture(GL_TEXTURE_2D, tex_height);
+			const bounds &root = m_tree.levels.back()[0];
+			if (isScaledHeightFormat(m_height_format) && (root.lo < m_height_offset || root.hi > m_height_offset + m_height_scale)) {
+				// out of the range the texture holds, so rescale all of it
+				heightRange(m_height_format, m_tree, m_height_scale, m_height_offset);
+				uploadHeights(0, 0, m_tex_width, m_tex_height, m_heights.data());
+			} else {
+				uploadHeights(x, y, w, h, data);
+			}
 
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, heights);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+			// neighbouring normals use these heights too
+			updateNormals(x - 1, y - 1, w + 2, h + 2);
+		}
 
-			updateNormals();
+		// as setHeights(), but the heights are copied into a pixel buffer and their bounds built on a
+		// background thread (AsyncExecutor must be started); pollUploads() installs them once that is done.
+		// returns false, leaving heights untouched, if every upload buffer is still in use.
+		// heights set directly in the meantime win; this upload is then dropped.
+		bool setHeightsAsync(std::vector<float> &&heights, int width, int height) {
+			assert(heights.size() == size_t(width) * height);
+
+			const GLenum format = heightInternalFormat(m_height_storage);
+			upload_slot *slot = freeUploadSlot();
+			if (!slot) return false;
+			mapUploadSlot(*slot, GLsizeiptr(heights.size() * heightTexelSize(format)));
+
+			auto up = std::make_shared<pending_upload>();
+			up->slot = slot;
+			up->width = width;
+			up->height = height;
+			up->format = format;
+			up->heights = std::move(heights);
+			slot->busy = true;
+			m_uploads.push_back(up);
+
+			void *dst = slot->ptr;
+			gecom::AsyncExecutor::enqueueSlow([up, dst]() {
+				up->tree.build(up->heights.data(), up->width, up->height);
+				heightRange(up->format, up->tree, up->scale, up->offset);
+				encodeHeights(up->format, up->scale, up->offset, up->heights.data(), up->heights.size(), dst);
+				up->ready.store(true, std::memory_order_release);
+			});
+
+			return true;
+		}
+
+		// install finished background uploads, oldest first.
+		// the texture is copied from the pixel buffer, so this doesnt wait on the heights.
+		void pollUploads() {
+			while (!m_uploads.empty() && m_uploads.front()->ready.load(std::memory_order_acquire)) {
+				std::shared_ptr<pending_upload> up = std::move(m_uploads.front());
+				m_uploads.pop_front();
+				upload_slot &slot = *up->slot;
+
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+				if (!slot.persistent) {
+					glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+					slot.ptr = nullptr;
+				}
+				if (up->stale) {
+					// superseded, and never copied from, so the buffer is free now
+					glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+					slot.busy = false;
+					continue;
+				}
+				allocHeights(up->width, up->height, up->format);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, up->width, up->height, GL_RED, heightUploadType(up->format), nullptr);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+				// the buffer can be refilled once the copy is done
+				slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+				slot.busy = false;
+
+				m_heights = std::move(up->heights);
+				m_tex_width = up->width;
+				m_tex_height = up->height;
+				m_tree = std::move(up->tree);
+				m_height_scale = up->scale;
+				m_height_offset = up->offset;
+
+				updateNormals();
+			}
 		}
 
 		void setHeights(std::string filename) {
 
 			image heightImage(image::type_png(), filename);
+			discardUploads();
+
+			// heights are the red channel
+			m_tex_width = heightImage.width();
+			m_tex_height = heightImage.height();
+			m_heights.resize(m_tex_width * m_tex_height);
+			for (size_t i = 0; i < m_heights.size(); i++) {
+				m_heights[i] = heightImage.data()[4 * i] / 255.f;
+			}
+			m_tree.build(m_heights.data(), m_tex_width, m_tex_height);
 
-			if (tex_height) glDeleteTextures(1, &tex_height);
+			m_height_scale = 1;
+			m_height_offset = 0;
+			allocHeights(heightImage.width(), heightImage.height(), GL_RGBA8);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, heightImage.width(), heightImage.height(), GL_RGBA, GL_UNSIGNED_BYTE, heightImage.data());
 
-			glGenTextures(1, &tex_height);
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, tex_height);
+			updateNormals();
+		}
 
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, heightImage.width(), heightImage.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, heightImage.data());
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		// compute normals on the cpu instead of with a render pass (see HeightmapNormals)
+		void setCPUNormals(bool cpu) {
+			m_cpu_normals = cpu;
+		}
+
+		bool getCPUNormals() const {
+			return m_cpu_normals;
+		}
+
+		// re-uploads the current heights in the new format
+		void setHeightFormat(HeightFormat format) {
+			if (format == m_height_storage) return;
+			m_height_storage = format;
+			if (m_height_format == GL_RGBA8) return;
+			std::vector<float> heights = m_heights;
+			setHeights(heights.data(), m_tex_width, m_tex_height);
+		}
 
+		HeightFormat getHeightFormat() const {
+			return m_height_storage;
+		}
+
+		// recomputes the normals in the new format
+		void setNormalFormat(NormalFormat format) {
+			if (format == m_normal_format) return;
+			m_normal_format = format;
 			updateNormals();
 		}
 
+		NormalFormat getNormalFormat() const {
+			return m_normal_format;
+		}
+
+		static const char * heightFormatName(HeightFormat format) {
+			switch (format) {
+			case HeightFormat::r32f:
+				return "R32F";
+			case HeightFormat::r16f:
+				return "R16F";
+			case HeightFormat::r16:
+				return "R16";
+			default:
+				return "?";
+			}
+		}
+
+		static const char * normalFormatName(NormalFormat format) {
+			switch (format) {
+			case NormalFormat::rgba16f:
+				return "RGBA16F";
+			case NormalFormat::rg16f:
+				return "RG16F octahedral";
+			case NormalFormat::rg8_snorm:
+				return "RG8_SNORM octahedral";
+			default:
+				return "?";
+			}
+		}
+
+		// bytes of height and normal texture
+		size_t getTextureBytes() const {
+			size_t norm = m_norm_format == NormalFormat::rgba16f ? 8 : m_norm_format == NormalFormat::rg16f ? 4 : 2;
+			return size_t(m_height_alloc_width) * m_height_alloc_height * (m_height_format == GL_RGBA8 ? 4 : heightTexelSize(m_height_format))
+				+ size_t(m_norm_width) * m_norm_height * norm;
+		}
+
 		void setPosition(const initial3d::vec3d &position) {
 			m_position = position;
 		}
@@ -264,7 +480,8 @@ namespace skadi {
 
 		void draw(initial3d::mat4f worldViewMat, initial3d::mat4f projMat, GLuint tex = 0) {
 
-			static GLuint prog = 0;
+			using namespace initial3d;
+
 			static const char *shader_prog_src = R"delim(
 
 			uniform mat4 modelViewMatrix;
@@ -272,12 +489,103 @@ namespace skadi {
 			uniform sampler2D sampler_heightmap;
 			uniform sampler2D sampler_normalmap;
 			uniform sampler2D sampler_diffuse;
+			// texture to model space height: scale, offset
+			uniform vec2 height_decode;
+			// normals are octahedral (upper half only) rather than xyz
+			uniform bool normal_oct;
+
+			// same mapping as the full mesh: model space [-1, 1] to texel centres
+			vec2 uvFromModel(vec2 p) {
+				vec2 ts = vec2(textureSize(sampler_heightmap, 0));
+				return ((p * 0.5 + 0.5) * (ts - 1.0) + 0.5) / ts;
+			}
 
-			#ifdef _VERTEX_
+			vec3 octDecode(ivec2 tx) {
+				vec2 e = texelFetch(sampler_normalmap, clamp(tx, ivec2(0), textureSize(sampler_normalmap, 0) - 1), 0).xy;
+				return normalize(vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y));
+			}
 
-			// input: model-space position and uv
-			layout(location = 0) in vec3 pos_m;
-			layout(location = 1) in vec2 uv;
+			vec3 normalFromMap(vec2 uv) {
+				if (!normal_oct) return texture(sampler_normalmap, uv).xyz;
+				// filter after decoding, as the encoding isnt linear where x or z changes sign
+				vec2 t = uv * vec2(textureSize(sampler_normalmap, 0)) - 0.5;
+				ivec2 t0 = ivec2(floor(t));
+				vec2 f = t - floor(t);
+				vec3 n0 = mix(octDecode(t0), octDecode(t0 + ivec2(1, 0)), f.x);
+				vec3 n1 = mix(octDecode(t0 + ivec2(0, 1)), octDecode(t0 + ivec2(1, 1)), f.x);
+				return mix(n0, n1, f.y);
+			}
+
+			#if defined(_VERTEX_) && defined(TESSELLATED)
+
+			// node of the coarse grid, per instance
+			layout(location = 0) in ivec2 node;
+
+			// grid position, in nodes. whole numbers, so corners shared between patches are exactly equal.
+			out vec2 grid_v;
+
+			void main() {
+				// patch corners are (0, 0), (1, 0), (1, 1), (0, 1)
+				grid_v = vec2(node + ivec2(gl_VertexID == 1 || gl_VertexID == 2, gl_VertexID >= 2));
+			}
+
+			#endif
+
+			#ifdef _TESS_CONTROL_
+
+			layout(vertices = 4) out;
+
+			// model space node size
+			uniform float node_size;
+			// projection y scale * half the viewport height / allowed error in pixels
+			uniform float error_scale;
+			// texels along a node edge; no point subdividing further
+			uniform float node_texels;
+
+			in vec2 grid_v[];
+			out vec2 grid_tc[];
+
+			vec3 viewFromGrid(vec2 g) {
+				vec2 p = clamp(g * node_size - 1.0, -1.0, 1.0);
+				float h = textureLod(sampler_heightmap, uvFromModel(p), 0.0).r * height_decode.x + height_decode.y;
+				return (modelViewMatrix * vec4(p.x, h, p.y, 1.0)).xyz;
+			}
+
+			// subdivision of an edge, from how far the heights along it stray from a straight line, on screen.
+			// this only depends on the edge, so patches either side of it agree and there are no cracks.
+			float edgeLevel(vec2 a, vec2 b) {
+				const int samples = 16;
+				vec3 va = viewFromGrid(a);
+				vec3 vb = viewFromGrid(b);
+				float e = 0.0;
+				for (int i = 1; i < samples; i++) {
+					float t = float(i) / float(samples);
+					e = max(e, distance(viewFromGrid(mix(a, b, t)), mix(va, vb, t)));
+				}
+				float d = max(0.5 * length(va + vb), 1e-4);
+				// subdividing n times cuts the error of a smooth curve by about n^2
+				return clamp(sqrt(e * error_scale / d), 1.0, node_texels);
+			}
+
+			void main() {
+				grid_tc[gl_InvocationID] = grid_v[gl_InvocationID];
+				if (gl_InvocationID == 0) {
+					// outer levels are for the u = 0, v = 0, u = 1 and v = 1 edges
+					gl_TessLevelOuter[0] = edgeLevel(grid_v[0], grid_v[3]);
+					gl_TessLevelOuter[1] = edgeLevel(grid_v[0], grid_v[1]);
+					gl_TessLevelOuter[2] = edgeLevel(grid_v[1], grid_v[2]);
+					gl_TessLevelOuter[3] = edgeLevel(grid_v[3], grid_v[2]);
+					// inner levels are free to differ from neighbours, so also look across the middle
+					vec2 mid0 = 0.5 * (grid_v[0] + grid_v[3]), mid1 = 0.5 * (grid_v[1] + grid_v[2]);
+					vec2 mid2 = 0.5 * (grid_v[0] + grid_v[1]), mid3 = 0.5 * (grid_v[3] + grid_v[2]);
+					gl_TessLevelInner[0] = max(edgeLevel(mid0, mid1), max(gl_TessLevelOuter[1], gl_TessLevelOuter[3]));
+					gl_TessLevelInner[1] = max(edgeLevel(mid2, mid3), max(gl_TessLevelOuter[0], gl_TessLevelOuter[2]));
+				}
+			}
+
+			#endif
+
+			#if defined(_VERTEX_) && !defined(TESSELLATED) || defined(_TESS_EVALUATION_)
 
 			out VertexData {
 				vec3 pos_w;
@@ -285,12 +593,82 @@ namespace skadi {
 				vec2 uv;
 			} vertex_out;
 
+			#if defined(CDLOD) || defined(INSTANCED)
+
+			// patch grid position, 0 to patch size, from the shared patch indices
+			vec2 patchGrid() {
+				return vec2(gl_VertexID % (PATCH_SIZE + 1), gl_VertexID / (PATCH_SIZE + 1));
+			}
+
+			#endif
+
+			#if defined(_TESS_EVALUATION_)
+
+			layout(quads, fractional_odd_spacing) in;
+
+			uniform float node_size;
+
+			in vec2 grid_tc[];
+
+			void main() {
+				vec2 c = gl_TessCoord.xy;
+				vec2 g = mix(mix(grid_tc[0], grid_tc[1], c.x), mix(grid_tc[3], grid_tc[2], c.x), c.y);
+				vec2 p = clamp(g * node_size - 1.0, -1.0, 1.0);
+				vec2 uv = uvFromModel(p);
+				vec3 pos_m = vec3(p.x, 0.0, p.y);
+
+			#elif defined(CDLOD)
+
+			// model space x and z of node corner, size of one grid cell
+			uniform vec3 node;
+			// morph start distance, 1 / morph length
+			uniform vec2 morph;
+			// model space camera position, and height above terrain for distances
+			uniform vec3 camera_m;
+			uniform float camera_dy;
+
+			void main() {
+				vec2 grid = patchGrid();
+				vec2 p = node.xy + grid * node.z;
+				// morph odd vertices onto even ones as distance approaches the next level,
+				// so the patch matches the coarser level where they meet
+				float d = length(vec3(p.x - camera_m.x, camera_dy, p.y - camera_m.z));
+				float k = clamp((d - morph.x) * morph.y, 0.0, 1.0);
+				vec2 g = grid - fract(grid * 0.5) * 2.0 * k;
+				p = clamp(node.xy + g * node.z, -1.0, 1.0);
+				vec2 uv = uvFromModel(p);
+				vec3 pos_m = vec3(p.x, 0.0, p.y);
+
+			#elif defined(INSTANCED)
+
+			// mesh size in edges
+			uniform ivec2 mesh_size;
+
+			void main() {
+				// one instance per patch, row major; the last row and column are clamped to the mesh
+				ivec2 tiles = (mesh_size + PATCH_SIZE - 1) / PATCH_SIZE;
+				ivec2 tile = ivec2(gl_InstanceID % tiles.x, gl_InstanceID / tiles.x);
+				ivec2 g = min(tile * PATCH_SIZE + ivec2(patchGrid()), mesh_size);
+				// same as the full mesh
+				vec2 p = vec2(g) / vec2(mesh_size) * 2.0 - 1.0;
+				vec3 pos_m = vec3(p.x, 0.0, p.y);
+				vec2 uv = (vec2(g) + 0.5) / vec2(mesh_size + 1);
+
+			#else
+
+			// input: model-space position and uv
+			layout(location = 0) in vec3 pos_m;
+			layout(location = 1) in vec2 uv;
+
 			void main() {
-				vec3 pos_w = pos_m + vec3(0, texture(sampler_heightmap, uv).r, 0);
+
+			#endif
+
+				vec3 pos_w = pos_m + vec3(0, texture(sampler_heightmap, uv).r * height_decode.x + height_decode.y, 0);
 				vec3 pos_v = (modelViewMatrix * vec4(pos_w, 1.0)).xyz;
 				gl_Position = projectionMatrix * vec4(pos_v, 1.0);
 				vertex_out.pos_w = pos_w;
-				vertex_out.norm_w = texture(sampler_normalmap, uv).xyz;
+				vertex_out.norm_w = normalFromMap(uv);
 				vertex_out.uv = uv;
 			}
 
@@ -308,7 +686,13 @@ namespace skadi {
 			out vec4 frag_color;
 
 			void main() {
-				vec3 d = normalize(vertex_in.norm_w).y * texture(sampler_diffuse, vertex_in.uv).rgb;
+			#ifdef TESSELLATED
+				// triangles can be large, so vertex normals would be too smooth
+				vec3 n = normalFromMap(vertex_in.uv);
+			#else
+				vec3 n = vertex_in.norm_w;
+			#endif
+				vec3 d = normalize(n).y * texture(sampler_diffuse, vertex_in.uv).rgb;
 				frag_color = vec4(vec3(d * 0.8), 1.0);
 			}
 
@@ -316,8 +700,32 @@ namespace skadi {
 
 			)delim";
 
-			if (prog == 0) {
-				prog = makeShaderProgram("330 core", { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, shader_prog_src);
+			// without tessellation shaders, tessellated draws as cdlod
+			const Mode mode = m_mode == Mode::tessellated && !tessellationSupported() ? Mode::cdlod : m_mode;
+
+			shader_program<terrain_uniforms> &prog = m_prog_terrain[int(mode)];
+			if (!prog) {
+				const std::string patch_def = "#define PATCH_SIZE " + std::to_string(patch_size) + "\n";
+				std::string profile = "330 core";
+				std::string mode_def;
+				std::vector<GLenum> stypes { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+				if (mode == Mode::cdlod) mode_def = "#define CDLOD\n";
+				if (mode == Mode::instanced) mode_def = "#define INSTANCED\n";
+				if (mode == Mode::tessellated) {
+					GLint major = 0;
+					glGetIntegerv(GL_MAJOR_VERSION, &major);
+					if (major >= 4) {
+						profile = "400 core";
+					} else {
+						mode_def = "#extension GL_ARB_tessellation_shader : require\n";
+					}
+					mode_def += "#define TESSELLATED\n";
+					stypes = { GL_VERTEX_SHADER, GL_TESS_CONTROL_SHADER, GL_TESS_EVALUATION_SHADER, GL_FRAGMENT_SHADER };
+				}
+				prog = shader_program<terrain_uniforms>(
+					profile, stypes, mode_def + patch_def + shader_prog_src,
+					{ { "sampler_heightmap", 0 }, { "sampler_normalmap", 1 }, { "sampler_diffuse", 2 } }
+				);
 			}
 
 			static GLuint tex_default = 0;
@@ -336,11 +744,11 @@ namespace skadi {
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
 			}
 
+			mat4f modelViewMat = worldViewMat * getModelWorldMatrix();
 
-			glUseProgram(prog);
-
-			glUniformMatrix4fv(glGetUniformLocation(prog, "projectionMatrix"), 1, true, initial3d::mat4f(projMat));
-			glUniformMatrix4fv(glGetUniformLocation(prog, "modelViewMatrix"), 1, true, worldViewMat * getModelWorldMatrix());
+			const terrain_uniforms &u = prog.use();
+			u.projectionMatrix.set(projMat);
+			u.modelViewMatrix.set(modelViewMat);
 
 			glActiveTexture(GL_TEXTURE0);
 			glBindTexture(GL_TEXTURE_2D, tex_height);
@@ -348,17 +756,98 @@ namespace skadi {
 			glBindTexture(GL_TEXTURE_2D, tex_norm);
 			glActiveTexture(GL_TEXTURE2);
 			glBindTexture(GL_TEXTURE_2D, tex ? tex : tex_default);
-			glUniform1i(glGetUniformLocation(prog, "sampler_heightmap"), 0);
-			glUniform1i(glGetUniformLocation(prog, "sampler_normalmap"), 1);
-			glUniform1i(glGetUniformLocation(prog, "sampler_diffuse"), 2);
-
-			glBindVertexArray(vao);
-			glDrawElements(GL_TRIANGLES, 6 * m_width * m_height, GL_UNSIGNED_INT, nullptr);
-			glBindVertexArray(0);
+			u.height_decode.set(m_height_scale, m_height_offset);
+			u.normal_oct.set(m_norm_format != NormalFormat::rgba16f);
+
+			if (mode == Mode::tessellated) {
+				drawTessellated(u, modelViewMat, projMat);
+			} else if (mode == Mode::cdlod) {
+				drawPatches(u, modelViewMat, projMat);
+			} else if (mode == Mode::instanced) {
+				const int tiles_x = (m_width + patch_size - 1) / patch_size;
+				const int tiles_y = (m_height + patch_size - 1) / patch_size;
+				u.mesh_size.set(m_width, m_height);
+				glBindVertexArray(vao_patch[int(m_indices)]);
+				drawPatch(0xF, tiles_x * tiles_y);
+				glBindVertexArray(0);
+				m_triangles = 2 * size_t(patch_size) * patch_size * tiles_x * tiles_y;
+			} else {
+				if (!m_mesh_valid) buildMesh();
+				glBindVertexArray(vao);
+				glDrawElements(GL_TRIANGLES, 6 * m_width * m_height, GL_UNSIGNED_INT, nullptr);
+				glBindVertexArray(0);
+				m_triangles = 2 * size_t(m_width) * m_height;
+			}
 
 			glUseProgram(0);
 		}
 
+		void setMode(Mode mode) {
+			m_mode = mode;
+		}
+
+		Mode getMode() const {
+			return m_mode;
+		}
+
+		void setIndices(Indices indices) {
+			m_indices = indices;
+		}
+
+		Indices getIndices() const {
+			return m_indices;
+		}
+
+		static const char * indicesName(Indices indices) {
+			switch (indices) {
+			case Indices::triangles:
+				return "triangles";
+			case Indices::strips:
+				return "strips";
+			default:
+				return "?";
+			}
+		}
+
+		static const char * modeName(Mode mode) {
+			switch (mode) {
+			case Mode::mesh:
+				return "mesh";
+			case Mode::instanced:
+				return "instanced";
+			case Mode::cdlod:
+				return "CDLOD";
+			case Mode::tessellated:
+				return "tessellated";
+			default:
+				return "?";
+			}
+		}
+
+		// triangles drawn by the last draw(); for tessellated, by a recent one
+		size_t getTriangleCount() const {
+			return m_triangles;
+		}
+
+		// screen space error allowed when tessellating, in pixels
+		void setTessellationError(float pixels) {
+			m_tess_error = pixels;
+		}
+
+		float getTessellationError() const {
+			return m_tess_error;
+		}
+
+		// whether the context can draw the tessellated mode (GL 4.0 or ARB_tessellation_shader)
+		static bool tessellationSupported() {
+			static const bool supported = [] {
+				GLint major = 0;
+				glGetIntegerv(GL_MAJOR_VERSION, &major);
+				return major >= 4 || glfwExtensionSupported("GL_ARB_tessellation_shader");
+			}();
+			return supported;
+		}
+
 		int getMeshWidth() {
 			return m_width;
 		}
@@ -368,8 +857,187 @@ namespace skadi {
 		}
 
 	private:
+		// shared patches are patch_size^2 quads; must be even, so cdlod quadrants line up with children
+		static const int patch_size = 32;
+		static const GLushort patch_restart = 0xFFFF;
+		// node range, in node sizes; at least 2, so morphing hides the seams between levels
+		static constexpr float lod_ratio = 2.5f;
+		// where in its range a level starts morphing into the next
+		static constexpr float morph_start = 0.7f;
+		// tessellated patches are nodes of this level, so at most 64 quads across (the least max tessellation level)
+		static const int tess_node_level = 1;
+
+		struct bounds {
+			float lo, hi;
+		};
+
+		// cdlod quadtree; level 0 is the finest. min / max height per node, row major.
+		// nodes entirely off the terrain have lo > hi.
+		struct bounds_tree {
+			std::vector<std::vector<bounds>> levels;
+			int leaf_count = 0;
+			float leaf_size = 0;
+
+			void build(const float *heights, int width, int height) {
+				// terrain resolution in quads, along the longer side
+				const int res = std::max(std::max(width, height) - 1, 1);
+				int leaves = 1;
+				while (leaves * patch_size < res) leaves *= 2;
+				leaf_count = leaves;
+				leaf_size = 2.f * patch_size / res;
+				levels.clear();
+				for (; leaves >= 1; leaves /= 2) {
+					levels.emplace_back(leaves * leaves);
+				}
+				update(heights, width, height, 0, 0, width, height);
+			}
+
+			// recompute the bounds of the nodes that sample a rectangle of texels
+			void update(const float *heights, int width, int height, int x, int y, int w, int h) {
+				// leaves overlapping the texels, give or take one for filtering
+				auto leaf = [&](int t, int size) {
+					float v = t * (size > 1 ? 2.f / (size - 1) : 0.f);
+					return std::max(0, std::min(leaf_count - 1, int(std::floor(v / leaf_size))));
+				};
+				int i0 = leaf(x - 1, width);
+				int i1 = leaf(x + w, width);
+				int j0 = leaf(y - 1, height);
+				int j1 = leaf(y + h, height);
+
+				// leaves, from the texels they sample
+				std::vector<bounds> &b = levels[0];
+#pragma omp parallel for
+				for (int j = j0; j <= j1; j++) {
+					for (int i = i0; i <= i1; i++) {
+						bounds r { INFINITY, -INFINITY };
+						float x0 = -1 + i * leaf_size;
+						float z0 = -1 + j * leaf_size;
+						if (x0 < 1 && z0 < 1) {
+							// round outwards, for filtering
+							auto texel = [](float v, int size, float (*round)(float)) {
+								return std::max(0, std::min(size - 1, int(round((std::min(v, 1.f) + 1) * 0.5f * (size - 1)))));
+							};
+							int tx0 = texel(x0, width, std::floor);
+							int tx1 = texel(x0 + leaf_size, width, std::ceil);
+							int tz0 = texel(z0, height, std::floor);
+							int tz1 = texel(z0 + leaf_size, height, std::ceil);
+							for (int tz = tz0; tz <= tz1; tz++) {
+								for (int tx = tx0; tx <= tx1; tx++) {
+									float t = heights[width * tz + tx];
+									r.lo = std::min(r.lo, t);
+									r.hi = std::max(r.hi, t);
+								}
+							}
+						}
+						b[leaf_count * j + i] = r;
+					}
+				}
+
+				// then each level from the one below
+				for (size_t level = 1, leaves = leaf_count; level < levels.size(); level++, leaves /= 2) {
+					const std::vector<bounds> &c = levels[level - 1];
+					std::vector<bounds> &b = levels[level];
+					i0 /= 2;
+					i1 /= 2;
+					j0 /= 2;
+					j1 /= 2;
+					for (int j = j0; j <= j1; j++) {
+						for (int i = i0; i <= i1; i++) {
+							bounds r { INFINITY, -INFINITY };
+							for (int k = 0; k < 4; k++) {
+								const bounds &ck = c[leaves * (2 * j + (k >> 1)) + 2 * i + (k & 1)];
+								r.lo = std::min(r.lo, ck.lo);
+								r.hi = std::max(r.hi, ck.hi);
+							}
+							b[leaves / 2 * j + i] = r;
+						}
+					}
+				}
+			}
+		};
+
+		// a patch to draw, with a bit for each quadrant (for the parts not covered by children)
+		struct patch_draw {
+			float x, z, size;
+			int level;
+			unsigned quadrants;
+		};
+
+		struct cdlod_view {
+			// model space camera, and its distance above the terrain height range
+			initial3d::vec3f camera;
+			float camera_dy;
+			// model space frustum planes, pointing inwards
+			float planes[6][4];
+		};
+
 		int m_width;
 		int m_height;
+		Mode m_mode = Mode::mesh;
+		size_t m_triangles = 0;
+
+		// heights as last set, for cdlod bounds and cpu normals
+		std::vector<float> m_heights;
+		int m_tex_width = 0;
+		int m_tex_height = 0;
+
+		// height texture storage, which is immutable where supported
+		HeightFormat m_height_storage = HeightFormat::r32f;
+		GLenum m_height_format = 0;
+		int m_height_alloc_width = 0;
+		int m_height_alloc_height = 0;
+		// texture to model space, for the heights in the texture
+		float m_height_scale = 1;
+		float m_height_offset = 0;
+
+		bool m_cpu_normals = false;
+		NormalFormat m_normal_format = NormalFormat::rgba16f;
+		// normal texture as allocated
+		NormalFormat m_norm_format = NormalFormat::rgba16f;
+		GLint m_norm_width = 0;
+		GLint m_norm_height = 0;
+
+		bounds_tree m_tree;
+
+		// pixel buffer for streaming heights; persistently mapped where supported,
+		// otherwise mapped only while being filled
+		struct upload_slot {
+			GLuint pbo = 0;
+			GLsizeiptr capacity = 0;
+			void *ptr = nullptr;
+			bool persistent = false;
+			// last copy from this buffer
+			GLsync fence = nullptr;
+			// being filled or waiting to be installed
+			bool busy = false;
+		};
+
+		struct pending_upload {
+			upload_slot *slot = nullptr;
+			int width = 0;
+			int height = 0;
+			GLenum format = GL_R32F;
+			float scale = 1;
+			float offset = 0;
+			std::vector<float> heights;
+			bounds_tree tree;
+			std::atomic<bool> ready { false };
+			// older than heights set since
+			bool stale = false;
+		};
+
+		// ring of upload buffers, and uploads in the order they were started
+		upload_slot m_upload_slots[3];
+		std::deque<std::shared_ptr<pending_upload>> m_uploads;
+		std::vector<patch_draw> m_patch_draws;
+
+		// per index format
+		Indices m_indices = Indices::triangles;
+		GLuint vao_patch[2] { 0, 0 };
+		GLuint ibo_patch[2] { 0, 0 };
+		GLsizei m_quadrant_indices[2] { 0, 0 };
+
+		bool m_mesh_valid = false;
 		
 		GLuint vao = 0;
 		GLuint ibo = 0;
@@ -380,7 +1048,551 @@ namespace skadi {
 		GLuint tex_norm = 0;
 		GLuint fbo = 0;
 
+		struct normal_uniforms {
+			uniform<float, 2> height_decode;
+			uniform<bool> normal_oct;
+
+			explicit normal_uniforms(GLuint prog) :
+				height_decode(prog, "height_decode"),
+				normal_oct(prog, "normal_oct")
+			{ }
+		};
+
+		struct terrain_uniforms {
+			uniform<initial3d::mat4f> modelViewMatrix;
+			uniform<initial3d::mat4f> projectionMatrix;
+			uniform<float, 2> height_decode;
+			uniform<bool> normal_oct;
+			// instanced
+			uniform<GLint, 2> mesh_size;
+			// cdlod
+			uniform<float, 3> node;
+			uniform<float, 2> morph;
+			uniform<float, 3> camera_m;
+			uniform<float> camera_dy;
+			// tessellated
+			uniform<float> node_size;
+			uniform<float> error_scale;
+			uniform<float> node_texels;
+
+			explicit terrain_uniforms(GLuint prog) :
+				modelViewMatrix(prog, "modelViewMatrix"),
+				projectionMatrix(prog, "projectionMatrix"),
+				height_decode(prog, "height_decode"),
+				normal_oct(prog, "normal_oct"),
+				mesh_size(prog, "mesh_size"),
+				node(prog, "node"),
+				morph(prog, "morph"),
+				camera_m(prog, "camera_m"),
+				camera_dy(prog, "camera_dy"),
+				node_size(prog, "node_size"),
+				error_scale(prog, "error_scale"),
+				node_texels(prog, "node_texels")
+			{ }
+		};
+
+		// made when first used
+		shader_program<normal_uniforms> m_prog_normals;
+		// per mode
+		shader_program<terrain_uniforms> m_prog_terrain[4];
+
+		// tessellated: visible nodes, and the primitives query for the triangle count
+		float m_tess_error = 1.f;
+		std::vector<GLint> m_tess_nodes;
+		GLuint vao_tess = 0;
+		GLuint vbo_tess = 0;
+		GLuint query_tess = 0;
+		bool m_tess_query_pending = false;
+		size_t m_tess_triangles = 0;
+
 		initial3d::vec3d m_position;
 		initial3d::vec3d m_scale;
+
+		// full mesh buffers, one vertex per grid point
+		void buildMesh() {
+
+			const int width = m_width;
+			const int height = m_height;
+
+			std::vector<GLuint> idx;
+			std::vector<float> pos;
+			std::vector<float> uv;
+
+			for (int y = 0; y <= height; y++) {
+				for (int x = 0; x <= width; x++) {
+					pos.push_back(2 * x / float(width) - 1);
+					pos.push_back(0);
+					pos.push_back(2 * y / float(height) - 1);
+					// 
+					uv.push_back((x + 0.5) / float(width + 1));
+					uv.push_back((y + 0.5) / float(height + 1));
+				}
+			}
+
+			auto get_index = [&](int x, int y) -> unsigned {
+				// reserve index 0 for 'not a vertex'
+				// i dont think ^^^ is what this does anymore...
+				if (x < 0 || x > width) return 0;
+				if (y < 0 || y > height) return 0;
+				return unsigned(width + 1) * unsigned(y) + unsigned(x);
+			};
+
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+
+					// 1---3 //
+					// | /   //
+					// 2     //
+					idx.push_back(get_index(  x  ,   y  ));
+					idx.push_back(get_index(  x  , y + 1));
+					idx.push_back(get_index(x + 1,   y  ));
+
+					//     2 //
+					//   / | //
+					// 3---1 //
+					idx.push_back(get_index(x + 1, y + 1));
+					idx.push_back(get_index(x + 1,   y  ));
+					idx.push_back(get_index(  x  , y + 1));
+				}
+			}
+
+
+			if (!vao) {
+				glGenVertexArrays(1, &vao);
+				glGenBuffers(1, &ibo);
+				glGenBuffers(1, &vbo_pos);
+				glGenBuffers(1, &vbo_uv);
+			}
+
+			glBindVertexArray(vao);
+
+			// upload indices
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo); // this sticks to the vao
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, idx.size() * sizeof(GLuint), &idx[0], GL_DYNAMIC_DRAW);
+
+			// upload positions
+			glBindBuffer(GL_ARRAY_BUFFER, vbo_pos);
+			glBufferData(GL_ARRAY_BUFFER, pos.size() * sizeof(float), &pos[0], GL_DYNAMIC_DRAW);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+			// upload texture coord
+			glBindBuffer(GL_ARRAY_BUFFER, vbo_uv);
+			glBufferData(GL_ARRAY_BUFFER, uv.size() * sizeof(float), &uv[0], GL_DYNAMIC_DRAW);
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+			// cleanup
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			glBindVertexArray(0);
+			m_mesh_valid = true;
+		}
+
+		// uploads still in flight must not replace heights set after they started
+		void discardUploads() {
+			for (const std::shared_ptr<pending_upload> &up : m_uploads) {
+				up->stale = true;
+			}
+		}
+
+		// an upload buffer that isnt being filled and isnt being copied from, if any
+		upload_slot * freeUploadSlot() {
+			for (upload_slot &slot : m_upload_slots) {
+				if (slot.busy) continue;
+				if (slot.fence) {
+					if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED) continue;
+					glDeleteSync(slot.fence);
+					slot.fence = nullptr;
+				}
+				return &slot;
+			}
+			return nullptr;
+		}
+
+		// make an upload buffer at least size bytes, and mapped for writing
+		void mapUploadSlot(upload_slot &slot, GLsizeiptr size) {
+			static const bool has_storage = glfwExtensionSupported("GL_ARB_buffer_storage");
+			if (has_storage) {
+				if (slot.pbo && slot.capacity >= size) return;
+				// immutable, so replace it (deleting also unmaps)
+				if (slot.pbo) glDeleteBuffers(1, &slot.pbo);
+				const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				glGenBuffers(1, &slot.pbo);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+				glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+				slot.ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+				slot.capacity = size;
+				slot.persistent = true;
+			} else {
+				if (!slot.pbo) glGenBuffers(1, &slot.pbo);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+				if (slot.capacity < size) {
+					glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+					slot.capacity = size;
+				}
+				// the last copy from it is done, so no need to sync
+				slot.ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+
+		static GLenum heightInternalFormat(HeightFormat format) {
+			switch (format) {
+			case HeightFormat::r16f:
+				return GL_R16F;
+			case HeightFormat::r16:
+				return GL_R16;
+			default:
+				return GL_R32F;
+			}
+		}
+
+		// formats holding heights scaled to the range of the map
+		static bool isScaledHeightFormat(GLenum format) {
+			return format == GL_R16F || format == GL_R16;
+		}
+
+		// type of encoded heights for a format
+		static GLenum heightUploadType(GLenum format) {
+			switch (format) {
+			case GL_R16F:
+				return GL_HALF_FLOAT;
+			case GL_R16:
+				return GL_UNSIGNED_SHORT;
+			default:
+				return GL_FLOAT;
+			}
+		}
+
+		static size_t heightTexelSize(GLenum format) {
+			return isScaledHeightFormat(format) ? sizeof(GLushort) : sizeof(float);
+		}
+
+		// texture to model space scale and offset, to cover the range of the heights
+		static void heightRange(GLenum format, const bounds_tree &tree, float &scale, float &offset) {
+			scale = 1;
+			offset = 0;
+			if (!isScaledHeightFormat(format) || tree.levels.empty()) return;
+			const bounds &root = tree.levels.back()[0];
+			offset = root.lo;
+			if (root.hi > root.lo) scale = root.hi - root.lo;
+		}
+
+		// round to nearest half float; heights to encode are in [0, 1], so no need for inf or nan
+		static GLushort toHalf(float f) {
+			uint32_t x;
+			std::memcpy(&x, &f, sizeof(x));
+			const uint32_t sign = (x >> 16) & 0x8000;
+			const int e = int((x >> 23) & 0xFF) - 127 + 15;
+			uint32_t m = x & 0x7FFFFF;
+			if (e >= 31) return GLushort(sign | 0x7C00);
+			if (e <= 0) {
+				// subnormal
+				if (e < -10) return GLushort(sign);
+				m |= 0x800000;
+				const int shift = 14 - e;
+				return GLushort(sign | ((m + (1u << (shift - 1))) >> shift));
+			}
+			// rounding may carry into the exponent, which is still right
+			return GLushort((sign | uint32_t(e) << 10 | m >> 13) + ((m >> 12) & 1));
+		}
+
+		// heights to the upload type of a format
+		static void encodeHeights(GLenum format, float scale, float offset, const float *src, size_t n, void *dst) {
+			const float k = 1.f / scale;
+			if (format == GL_R16F) {
+				GLushort *d = static_cast<GLushort *>(dst);
+				for (size_t i = 0; i < n; i++) {
+					d[i] = toHalf((src[i] - offset) * k);
+				}
+			} else if (format == GL_R16) {
+				GLushort *d = static_cast<GLushort *>(dst);
+				for (size_t i = 0; i < n; i++) {
+					d[i] = GLushort(std::max(0.f, std::min(65535.f, (src[i] - offset) * k * 65535.f + 0.5f)));
+				}
+			} else {
+				std::memcpy(dst, src, n * sizeof(float));
+			}
+		}
+
+		// upload a rectangle of heights (w * h) to the height texture, bound to unit 0
+		void uploadHeights(int x, int y, int w, int h, const float *heights) {
+			if (!isScaledHeightFormat(m_height_format)) {
+				glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED, GL_FLOAT, heights);
+				return;
+			}
+			std::vector<GLushort> encoded(size_t(w) * h);
+			encodeHeights(m_height_format, m_height_scale, m_height_offset, heights, encoded.size(), encoded.data());
+			// rows of 16-bit texels arent 4-byte aligned
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED, heightUploadType(m_height_format), encoded.data());
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+
+		// make the height texture the given size and format, and bind it to unit 0.
+		// keeps the current texture if it already is.
+		void allocHeights(int width, int height, GLenum format) {
+			glActiveTexture(GL_TEXTURE0);
+
+			if (tex_height && width == m_height_alloc_width && height == m_height_alloc_height && format == m_height_format) {
+				glBindTexture(GL_TEXTURE_2D, tex_height);
+				return;
+			}
+
+			if (tex_height) glDeleteTextures(1, &tex_height);
+
+			glGenTextures(1, &tex_height);
+			glBindTexture(GL_TEXTURE_2D, tex_height);
+
+			static const bool has_storage = glfwExtensionSupported("GL_ARB_texture_storage");
+			if (has_storage) {
+				glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+			} else if (format != GL_RGBA8) {
+				glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RED, GL_FLOAT, nullptr);
+			} else {
+				glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+			}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+			m_height_format = format;
+			m_height_alloc_width = width;
+			m_height_alloc_height = height;
+		}
+
+		// shared patch, for instancing and cdlod: indices only, positions come from gl_VertexID.
+		// triangles are grouped by quadrant.
+		void genPatch() {
+			const int n = patch_size;
+			static_assert((n + 1) * (n + 1) < 0xFFFF, "patch indices must fit in 16 bits, with room for restart");
+
+			auto index = [=](int x, int y) {
+				return GLushort((n + 1) * y + x);
+			};
+
+			std::vector<GLushort> tris, strips;
+
+			for (int q = 0; q < 4; q++) {
+				int x0 = (q & 1) * n / 2;
+				int y0 = (q >> 1) * n / 2;
+				for (int y = y0; y < y0 + n / 2; y++) {
+					for (int x = x0; x < x0 + n / 2; x++) {
+						// same triangles as the full mesh
+						tris.push_back(index(x, y));
+						tris.push_back(index(x, y + 1));
+						tris.push_back(index(x + 1, y));
+						tris.push_back(index(x + 1, y + 1));
+						tris.push_back(index(x + 1, y));
+						tris.push_back(index(x, y + 1));
+					}
+					// the same triangles again, as one strip per row
+					for (int x = x0; x <= x0 + n / 2; x++) {
+						strips.push_back(index(x, y));
+						strips.push_back(index(x, y + 1));
+					}
+					strips.push_back(GLushort(patch_restart));
+				}
+			}
+
+			glGenVertexArrays(2, vao_patch);
+			glGenBuffers(2, ibo_patch);
+
+			const std::vector<GLushort> *idx[2] { &tris, &strips };
+			for (int i = 0; i < 2; i++) {
+				m_quadrant_indices[i] = GLsizei(idx[i]->size() / 4);
+				glBindVertexArray(vao_patch[i]);
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_patch[i]);
+				glBufferData(GL_ELEMENT_ARRAY_BUFFER, idx[i]->size() * sizeof(GLushort), idx[i]->data(), GL_STATIC_DRAW);
+			}
+			glBindVertexArray(0);
+		}
+
+		// draw some quadrants of the shared patch, with its vao bound
+		void drawPatch(unsigned quadrants, GLsizei instances = 1) {
+			const bool strip = m_indices == Indices::strips;
+			const GLenum prim = strip ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+			const GLsizei count = m_quadrant_indices[int(m_indices)];
+			if (strip) {
+				glEnable(GL_PRIMITIVE_RESTART);
+				glPrimitiveRestartIndex(patch_restart);
+			}
+			if (quadrants == 0xF) {
+				glDrawElementsInstanced(prim, 4 * count, GL_UNSIGNED_SHORT, nullptr, instances);
+			} else {
+				for (int k = 0; k < 4; k++) {
+					if (!(quadrants & (1 << k))) continue;
+					glDrawElementsInstanced(prim, count, GL_UNSIGNED_SHORT, reinterpret_cast<void *>(sizeof(GLushort) * count * k), instances);
+				}
+			}
+			if (strip) glDisable(GL_PRIMITIVE_RESTART);
+		}
+
+		// distance beyond which a level is not used; the top level is always in range
+		float lodRange(int level) const {
+			if (level + 1 >= int(m_tree.levels.size())) return INFINITY;
+			return lod_ratio * m_tree.leaf_size * float(1 << level);
+		}
+
+		// distance from the camera to a node, as measured for lod
+		float lodDistance(const cdlod_view &v, float x0, float z0, float size) const {
+			float dx = std::max(0.f, std::max(x0 - v.camera.x(), v.camera.x() - x0 - size));
+			float dz = std::max(0.f, std::max(z0 - v.camera.z(), v.camera.z() - z0 - size));
+			return std::sqrt(dx * dx + v.camera_dy * v.camera_dy + dz * dz);
+		}
+
+		bool inFrustum(const cdlod_view &v, float x0, float z0, float size, const bounds &b) const {
+			for (int i = 0; i < 6; i++) {
+				const float *p = v.planes[i];
+				// corner furthest along the plane normal
+				float x = p[0] > 0 ? x0 + size : x0;
+				float y = p[1] > 0 ? b.hi : b.lo;
+				float z = p[2] > 0 ? z0 + size : z0;
+				if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0) return false;
+			}
+			return true;
+		}
+
+		// CDLOD node selection. returns false if the node is out of range for its level,
+		// in which case its parent draws that area instead.
+		bool selectPatches(const cdlod_view &v, int level, int i, int j) {
+			const bounds &b = m_tree.levels[level][(m_tree.leaf_count >> level) * j + i];
+			// off the terrain, nothing to draw
+			if (b.lo > b.hi) return true;
+			const float size = m_tree.leaf_size * float(1 << level);
+			const float x0 = -1 + i * size;
+			const float z0 = -1 + j * size;
+			const float d = lodDistance(v, x0, z0, size);
+			if (d > lodRange(level)) return false;
+			// culled, but in range, so the parent shouldnt draw it either
+			if (!inFrustum(v, x0, z0, size, b)) return true;
+			if (level == 0 || d > lodRange(level - 1)) {
+				m_patch_draws.push_back({ x0, z0, size, level, 0xF });
+				return true;
+			}
+			unsigned quadrants = 0;
+			for (int k = 0; k < 4; k++) {
+				if (!selectPatches(v, level - 1, 2 * i + (k & 1), 2 * j + (k >> 1))) quadrants |= 1 << k;
+			}
+			if (quadrants) m_patch_draws.push_back({ x0, z0, size, level, quadrants });
+			return true;
+		}
+
+		cdlod_view makeView(const initial3d::mat4f &modelViewMat, const initial3d::mat4f &projMat) const {
+			using namespace initial3d;
+
+			cdlod_view v;
+
+			// camera in model space
+			vec4f c = (!modelViewMat) * vec4f(0, 0, 0, 1);
+			v.camera = vec3f(c.x() / c.w(), c.y() / c.w(), c.z() / c.w());
+			const bounds &root = m_tree.levels.back()[0];
+			v.camera_dy = std::max(0.f, std::max(root.lo - v.camera.y(), v.camera.y() - root.hi));
+
+			// frustum planes from the model to clip transform
+			mat4f m = projMat * modelViewMat;
+			for (int i = 0; i < 3; i++) {
+				for (int k = 0; k < 4; k++) {
+					v.planes[2 * i][k] = m(3, k) + m(i, k);
+					v.planes[2 * i + 1][k] = m(3, k) - m(i, k);
+				}
+			}
+
+			return v;
+		}
+
+		void drawPatches(const terrain_uniforms &u, const initial3d::mat4f &modelViewMat, const initial3d::mat4f &projMat) {
+			using namespace initial3d;
+
+			m_triangles = 0;
+			if (m_tree.levels.empty()) return;
+
+			const cdlod_view v = makeView(modelViewMat, projMat);
+
+			m_patch_draws.clear();
+			selectPatches(v, int(m_tree.levels.size()) - 1, 0, 0);
+
+			u.camera_m.set(v.camera.x(), v.camera.y(), v.camera.z());
+			u.camera_dy.set(v.camera_dy);
+
+			glBindVertexArray(vao_patch[int(m_indices)]);
+			for (const patch_draw &d : m_patch_draws) {
+				u.node.set(d.x, d.z, d.size / patch_size);
+				// morph towards the next level before its range is reached
+				float r0 = d.level > 0 ? lodRange(d.level - 1) : 0.f;
+				float r1 = lodRange(d.level);
+				float m0 = r0 + morph_start * (r1 - r0);
+				u.morph.set(std::isinf(r1) ? 1e30f : m0, std::isinf(r1) ? 0.f : 1.f / (r1 - m0));
+				drawPatch(d.quadrants);
+				for (int k = 0; k < 4; k++) {
+					if (d.quadrants & (1 << k)) m_triangles += patch_size * patch_size / 2;
+				}
+			}
+			glBindVertexArray(0);
+		}
+
+		// one patch per visible node, subdivided by the tessellation shaders
+		void drawTessellated(const terrain_uniforms &u, const initial3d::mat4f &modelViewMat, const initial3d::mat4f &projMat) {
+			// the count comes back some frames later, so as not to stall
+			if (m_tess_query_pending) {
+				GLint available = 0;
+				glGetQueryObjectiv(query_tess, GL_QUERY_RESULT_AVAILABLE, &available);
+				if (available) {
+					GLuint prims = 0;
+					glGetQueryObjectuiv(query_tess, GL_QUERY_RESULT, &prims);
+					m_tess_triangles = prims;
+					m_tess_query_pending = false;
+				}
+			}
+			m_triangles = m_tess_triangles;
+			if (m_tree.levels.empty()) return;
+
+			const cdlod_view v = makeView(modelViewMat, projMat);
+			const int level = std::min(tess_node_level, int(m_tree.levels.size()) - 1);
+			const int nodes = m_tree.leaf_count >> level;
+			const float size = m_tree.leaf_size * float(1 << level);
+
+			m_tess_nodes.clear();
+			for (int j = 0; j < nodes; j++) {
+				for (int i = 0; i < nodes; i++) {
+					const bounds &b = m_tree.levels[level][nodes * j + i];
+					if (b.lo > b.hi || !inFrustum(v, -1 + i * size, -1 + j * size, size, b)) continue;
+					m_tess_nodes.push_back(i);
+					m_tess_nodes.push_back(j);
+				}
+			}
+
+			if (!vao_tess) {
+				glGenVertexArrays(1, &vao_tess);
+				glGenBuffers(1, &vbo_tess);
+				glGenQueries(1, &query_tess);
+				glBindVertexArray(vao_tess);
+				glBindBuffer(GL_ARRAY_BUFFER, vbo_tess);
+				glVertexAttribIPointer(0, 2, GL_INT, 0, nullptr);
+				glVertexAttribDivisor(0, 1);
+				glEnableVertexAttribArray(0);
+			}
+			glBindVertexArray(vao_tess);
+			glBindBuffer(GL_ARRAY_BUFFER, vbo_tess);
+			glBufferData(GL_ARRAY_BUFFER, m_tess_nodes.size() * sizeof(GLint), m_tess_nodes.data(), GL_STREAM_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			GLint viewport[4];
+			glGetIntegerv(GL_VIEWPORT, viewport);
+			u.node_size.set(size);
+			u.node_texels.set(float(patch_size << level));
+			u.error_scale.set(projMat(1, 1) * 0.5f * viewport[3] / m_tess_error);
+
+			if (!m_tess_query_pending) glBeginQuery(GL_PRIMITIVES_GENERATED, query_tess);
+			glPatchParameteri(GL_PATCH_VERTICES, 4);
+			glDrawArraysInstanced(GL_PATCHES, 0, 4, GLsizei(m_tess_nodes.size() / 2));
+			if (!m_tess_query_pending) {
+				glEndQuery(GL_PRIMITIVES_GENERATED);
+				m_tess_query_pending = true;
+			}
+			glBindVertexArray(0);
+		}
 	};
 }
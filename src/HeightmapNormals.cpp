@@ -0,0 +1,137 @@
+
+#include <cassert>
+#include <cmath>
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+#include "HeightmapNormals.hpp"
+
+using namespace std;
+
+namespace {
+
+	// Around a texel, with height differences a (+x), b (-z), c (-x) and d (+z) to its neighbours
+	// and grid spacings dx and dz, the four triangle normals (unnormalized) are:
+	//   (-a dz, dx dz,  b dx)
+	//   ( c dz, dx dz,  b dx)
+	//   ( c dz, dx dz, -d dx)
+	//   (-a dz, dx dz, -d dx)
+
+	// one texel, any position
+	void texelNormal(const float *heights, int width, int height, float dx, float dz, int x, int y, float *n) {
+		const float *row = heights + size_t(width) * y;
+		const float h0 = row[x];
+		const bool has_a = x + 1 < width, has_b = y > 0, has_c = x > 0, has_d = y + 1 < height;
+		const float a = has_a ? row[x + 1] - h0 : 0;
+		const float b = has_b ? row[x - width] - h0 : 0;
+		const float c = has_c ? row[x - 1] - h0 : 0;
+		const float d = has_d ? row[x + width] - h0 : 0;
+
+		float sx = 0, sy = 0, sz = 0;
+		auto add = [&](float tx, float tz) {
+			const float ty = dx * dz;
+			const float l = sqrt(tx * tx + ty * ty + tz * tz);
+			sx += tx / l;
+			sy += ty / l;
+			sz += tz / l;
+		};
+		if (has_a && has_b) add(-a * dz, b * dx);
+		if (has_b && has_c) add(c * dz, b * dx);
+		if (has_c && has_d) add(c * dz, -d * dx);
+		if (has_d && has_a) add(-a * dz, -d * dx);
+
+		const float l = sqrt(sx * sx + sy * sy + sz * sz);
+		if (l > 0) {
+			n[0] = sx / l;
+			n[1] = sy / l;
+			n[2] = sz / l;
+		} else {
+			// no neighbours (a single texel)
+			n[0] = 0;
+			n[1] = 1;
+			n[2] = 0;
+		}
+	}
+
+	// 4 texels in a row, with all neighbours
+	void interiorNormals4(const float *row, int width, float dx, float dz, float *n) {
+		const __m128 h0 = _mm_loadu_ps(row);
+		const __m128 a = _mm_sub_ps(_mm_loadu_ps(row + 1), h0);
+		const __m128 b = _mm_sub_ps(_mm_loadu_ps(row - width), h0);
+		const __m128 c = _mm_sub_ps(_mm_loadu_ps(row - 1), h0);
+		const __m128 d = _mm_sub_ps(_mm_loadu_ps(row + width), h0);
+
+		const __m128 vdx = _mm_set1_ps(dx);
+		const __m128 vdz = _mm_set1_ps(dz);
+		const __m128 ty = _mm_set1_ps(dx * dz);
+		const __m128 ty2 = _mm_mul_ps(ty, ty);
+
+		const __m128 xa = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(a, vdz));
+		const __m128 xc = _mm_mul_ps(c, vdz);
+		const __m128 zb = _mm_mul_ps(b, vdx);
+		const __m128 zd = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(d, vdx));
+
+		__m128 sx = _mm_setzero_ps(), sy = _mm_setzero_ps(), sz = _mm_setzero_ps();
+		auto add = [&](__m128 tx, __m128 tz) {
+			const __m128 l = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, tx), ty2), _mm_mul_ps(tz, tz)));
+			sx = _mm_add_ps(sx, _mm_div_ps(tx, l));
+			sy = _mm_add_ps(sy, _mm_div_ps(ty, l));
+			sz = _mm_add_ps(sz, _mm_div_ps(tz, l));
+		};
+		add(xa, zb);
+		add(xc, zb);
+		add(xc, zd);
+		add(xa, zd);
+
+		// sy > 0, so never zero length
+		const __m128 l = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), _mm_mul_ps(sz, sz)));
+		float x[4], y[4], z[4];
+		_mm_storeu_ps(x, _mm_div_ps(sx, l));
+		_mm_storeu_ps(y, _mm_div_ps(sy, l));
+		_mm_storeu_ps(z, _mm_div_ps(sz, l));
+		for (int i = 0; i < 4; i++) {
+			n[3 * i] = x[i];
+			n[3 * i + 1] = y[i];
+			n[3 * i + 2] = z[i];
+		}
+	}
+
+}
+
+namespace skadi {
+
+	void HeightmapNormals::compute(const float *heights, int width, int height, float *normals) {
+		compute(heights, width, height, 0, 0, width, height, normals);
+	}
+
+	void HeightmapNormals::compute(const float *heights, int width, int height, int x0, int y0, int w, int h, float *normals) {
+		assert(x0 >= 0 && y0 >= 0 && x0 + w <= width && y0 + h <= height);
+		const int x1 = x0 + w;
+		const int y1 = y0 + h;
+
+		// grid spacing; unused along an axis with only one texel
+		const float dx = width > 1 ? 2.f / (width - 1) : 0.f;
+		const float dz = height > 1 ? 2.f / (height - 1) : 0.f;
+
+#pragma omp parallel for
+		for (int y = y0; y < y1; y++) {
+			const float *row = heights + size_t(width) * y;
+			float *nrow = normals + size_t(w) * (y - y0) * 3;
+			int x = x0;
+			if (y > 0 && y + 1 < height) {
+				// edge texels one at a time, the rest 4 at a time
+				for (; x < x1 && x < 1; x++) {
+					texelNormal(heights, width, height, dx, dz, x, y, nrow + 3 * (x - x0));
+				}
+				for (; x + 4 <= x1 && x + 4 < width; x += 4) {
+					interiorNormals4(row + x, width, dx, dz, nrow + 3 * (x - x0));
+				}
+			}
+			for (; x < x1; x++) {
+				texelNormal(heights, width, height, dx, dz, x, y, nrow + 3 * (x - x0));
+			}
+		}
+	}
+
+}
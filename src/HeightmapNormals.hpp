@@ -0,0 +1,18 @@
+#pragma once
+
+namespace skadi {
+
+	// Terrain normals on the CPU, the same as Heightmap's normal pass, without needing GL.
+	//
+	// Heights are row major, with the terrain spanning [-1, 1] in x and z (as Heightmap draws it).
+	// Each normal is the average of the normals of the four triangles around its texel,
+	// or of those that exist at the edges. Normals are written as xyz, 3 floats per texel.
+	class HeightmapNormals {
+	public:
+		static void compute(const float *heights, int width, int height, float *normals);
+
+		// only the texels in a rectangle, which must lie within the map; normals is just the rectangle (w * h)
+		static void compute(const float *heights, int width, int height, int x0, int y0, int w, int h, float *normals);
+	};
+
+}
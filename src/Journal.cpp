@@ -0,0 +1,524 @@
+
+#include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+#include "Graph.hpp"
+
+using namespace std;
+using namespace initial3d;
+
+namespace skadi {
+
+	// Edit history as a journal of changes.
+	// Each edit is a byte stream of packed records, which refer to nodes by pointer and id.
+	// Nodes recreated by undo / redo keep their id but not their address, so ids are
+	// mapped to new addresses as needed.
+	class Graph::Journal {
+	public:
+		enum op_type : uint8_t {
+			op_add_node,
+			op_delete_node,
+			op_add_edge,
+			op_delete_edge,
+			op_move,
+			op_fixed,
+			op_select,
+			op_elevation
+		};
+
+#pragma pack(push, 1)
+		struct node_ref {
+			Node *ptr;
+			uint32_t id;
+		};
+
+		struct node_state {
+			float x, y;
+			float elevation;
+			float sharpness;
+			float mass;
+			float charge;
+			uint8_t fixed;
+			uint8_t selected;
+		};
+
+		struct node_op {
+			uint8_t type;
+			node_ref n;
+			node_state s;
+		};
+
+		struct edge_op {
+			uint8_t type;
+			node_ref n1, n2;
+			float spring;
+		};
+
+		// positions rather than offsets, so undo puts nodes back exactly
+		struct move_op {
+			uint8_t type;
+			node_ref n;
+			float x0, y0;
+			float x1, y1;
+		};
+
+		struct flag_op {
+			uint8_t type;
+			node_ref n;
+			uint8_t before, after;
+		};
+
+		struct elevation_op {
+			uint8_t type;
+			node_ref n;
+			float before, after;
+		};
+#pragma pack(pop)
+
+		// records must be packed, whatever the pointer size
+		static_assert(sizeof(node_ref) == sizeof(Node *) + 4, "node_ref not packed");
+		static_assert(sizeof(node_state) == 6 * 4 + 2, "node_state not packed");
+		static_assert(sizeof(node_op) == 1 + sizeof(node_ref) + sizeof(node_state), "node record not packed");
+		static_assert(sizeof(edge_op) == 1 + 2 * sizeof(node_ref) + 4, "edge record not packed");
+		static_assert(sizeof(move_op) == 1 + sizeof(node_ref) + 4 * 4, "move record not packed");
+		static_assert(sizeof(flag_op) == 1 + sizeof(node_ref) + 2, "flag record not packed");
+		static_assert(sizeof(elevation_op) == 1 + sizeof(node_ref) + 2 * 4, "elevation record not packed");
+
+		using edit = vector<char>;
+
+		// limits on remembered history
+		static const size_t max_bytes = 64 << 20;
+		static const size_t max_edits = 1000;
+
+		deque<edit> undo_edits;
+		deque<edit> redo_edits;
+		size_t bytes = 0;
+
+		// edit being recorded
+		edit current;
+		int depth = 0;
+
+		// (id, op type) -> offset in current edit, for merging repeated changes
+		unordered_map<uint64_t, size_t> merge;
+
+		// id -> address of nodes recreated by undo / redo
+		unordered_map<uint32_t, Node *> recreated;
+
+		// id -> references from edits in history, so entries in recreated can be
+		// dropped once no remembered edit refers to them
+		unordered_map<uint32_t, size_t> id_refs;
+
+		static size_t opSize(uint8_t type) {
+			switch (type) {
+			case op_add_node:
+			case op_delete_node:
+				return sizeof(node_op);
+			case op_add_edge:
+			case op_delete_edge:
+				return sizeof(edge_op);
+			case op_move:
+				return sizeof(move_op);
+			case op_fixed:
+			case op_select:
+				return sizeof(flag_op);
+			case op_elevation:
+				return sizeof(elevation_op);
+			default:
+				assert(false);
+				return 0;
+			}
+		}
+
+		template <typename T>
+		static T load(const edit &e, size_t offset) {
+			T x;
+			memcpy(&x, e.data() + offset, sizeof(T));
+			return x;
+		}
+
+		template <typename T>
+		static void store(edit &e, size_t offset, const T &x) {
+			memcpy(e.data() + offset, &x, sizeof(T));
+		}
+
+		template <typename T>
+		size_t append(const T &x) {
+			size_t offset = current.size();
+			current.resize(offset + sizeof(T));
+			store(current, offset, x);
+			return offset;
+		}
+
+		// offset of an earlier record for the same node and type, or append a new one.
+		// returns true if the record already existed.
+		template <typename T>
+		bool mergeable(Node *n, uint8_t type, const T &x, size_t &offset) {
+			auto r = merge.emplace((uint64_t(n->getID()) << 8) | type, current.size());
+			if (!r.second) {
+				offset = r.first->second;
+				return true;
+			}
+			offset = append(x);
+			return false;
+		}
+
+		static node_ref ref(Node *n) {
+			node_ref r;
+			r.ptr = n;
+			r.id = n->getID();
+			return r;
+		}
+
+		static node_state state(Node *n) {
+			node_state s;
+			s.x = n->position.x();
+			s.y = n->position.y();
+			s.elevation = n->elevation;
+			s.sharpness = n->sharpness;
+			s.mass = n->mass;
+			s.charge = n->charge;
+			s.fixed = n->fixed;
+			s.selected = n->selected;
+			return s;
+		}
+
+		// each node id referred to by each record of an edit
+		template <typename FunT>
+		static void forEachId(const edit &e, FunT f) {
+			for (size_t offset = 0; offset < e.size(); offset += opSize(uint8_t(e[offset]))) {
+				switch (uint8_t(e[offset])) {
+				case op_add_edge:
+				case op_delete_edge:
+				{
+					edge_op op = load<edge_op>(e, offset);
+					f(op.n1.id);
+					f(op.n2.id);
+					break;
+				}
+				default:
+					// every other record starts with its node
+					f(load<node_ref>(e, offset + 1).id);
+				}
+			}
+		}
+
+		// an edit enters history
+		void retain(const edit &e) {
+			forEachId(e, [&](uint32_t id) { id_refs[id]++; });
+		}
+
+		// an edit leaves history
+		void release(const edit &e) {
+			forEachId(e, [&](uint32_t id) {
+				auto it = id_refs.find(id);
+				assert(it != id_refs.end());
+				if (--it->second == 0) {
+					id_refs.erase(it);
+					recreated.erase(id);
+				}
+			});
+		}
+
+		// current address of a node, or null if it no longer exists
+		Node * resolve(Graph &g, const node_ref &r) {
+			if (g.containsNode(r.ptr) && r.ptr->id == r.id) return r.ptr;
+			auto it = recreated.find(unsigned(r.id));
+			if (it != recreated.end() && g.containsNode(it->second) && it->second->id == r.id) return it->second;
+			return nullptr;
+		}
+
+		// bring back a deleted node with its original id
+		Node * restore(Graph &g, const node_ref &r, const node_state &s) {
+			if (Node *n = resolve(g, r)) return n;
+			Node *n = new (g.node_pool.allocate()) Node(vec3f(float(s.x), float(s.y), 0), float(s.elevation), float(s.sharpness));
+			n->id = r.id;
+			n->mass = s.mass;
+			n->charge = s.charge;
+			g.listInsert(g.nodes, n, &Node::index);
+			if (g.grid_cell > 0.f) g.gridInsert(n);
+			g.setFixed(n, s.fixed);
+			if (s.selected) g.select(n, true);
+			recreated[unsigned(r.id)] = n;
+			return n;
+		}
+
+		void remove(Graph &g, edit &e, size_t offset) {
+			node_op op = load<node_op>(e, offset);
+			if (Node *n = resolve(g, op.n)) {
+				// remember the latest state, for bringing it back
+				op.s = state(n);
+				store(e, offset, op);
+				g.deleteNode(n);
+			}
+		}
+
+		void link(Graph &g, const edge_op &op) {
+			Node *n1 = resolve(g, op.n1);
+			Node *n2 = resolve(g, op.n2);
+			if (!n1 || !n2) return;
+			g.addEdge(n1, n2)->spring = op.spring;
+		}
+
+		void unlink(Graph &g, edit &e, size_t offset) {
+			edge_op op = load<edge_op>(e, offset);
+			Node *n1 = resolve(g, op.n1);
+			Node *n2 = resolve(g, op.n2);
+			if (!n1 || !n2) return;
+			if (Edge *x = n1->findEdge(n2)) {
+				op.spring = x->spring;
+				store(e, offset, op);
+				g.deleteEdge(x);
+			}
+		}
+
+		// apply one record forwards (redo) or backwards (undo)
+		void apply(Graph &g, edit &e, size_t offset, bool forward) {
+			switch (uint8_t(e[offset])) {
+			case op_add_node:
+			case op_delete_node:
+				if (forward == (uint8_t(e[offset]) == op_add_node)) {
+					node_op op = load<node_op>(e, offset);
+					restore(g, op.n, op.s);
+				} else {
+					remove(g, e, offset);
+				}
+				break;
+			case op_add_edge:
+			case op_delete_edge:
+				if (forward == (uint8_t(e[offset]) == op_add_edge)) {
+					link(g, load<edge_op>(e, offset));
+				} else {
+					unlink(g, e, offset);
+				}
+				break;
+			case op_move:
+			{
+				move_op op = load<move_op>(e, offset);
+				if (Node *n = resolve(g, op.n)) {
+					// touchNode() only marks where the node ends up
+					g.markChanged(Graph::nodeRegion(n));
+					n->position = forward ? float3(op.x1, op.y1, 0) : float3(op.x0, op.y0, 0);
+					g.touchNode(n);
+				}
+				break;
+			}
+			case op_fixed:
+			{
+				flag_op op = load<flag_op>(e, offset);
+				if (Node *n = resolve(g, op.n)) g.setFixed(n, forward ? op.after : op.before);
+				break;
+			}
+			case op_select:
+			{
+				flag_op op = load<flag_op>(e, offset);
+				if (Node *n = resolve(g, op.n)) g.select(n, forward ? op.after : op.before);
+				break;
+			}
+			case op_elevation:
+			{
+				elevation_op op = load<elevation_op>(e, offset);
+				if (Node *n = resolve(g, op.n)) g.setElevation(n, forward ? op.after : op.before);
+				break;
+			}
+			default:
+				assert(false);
+			}
+		}
+
+		// apply a whole edit; changes made while doing so are not recorded
+		void apply(Graph &g, edit &e, bool forward) {
+			vector<size_t> offsets;
+			for (size_t offset = 0; offset < e.size(); offset += opSize(uint8_t(e[offset]))) {
+				offsets.push_back(offset);
+			}
+			if (forward) {
+				for (size_t offset : offsets) apply(g, e, offset, true);
+			} else {
+				for (size_t i = offsets.size(); i --> 0; ) apply(g, e, offsets[i], false);
+			}
+		}
+
+		// edits moving between undo and redo stay in history, so only new ones are retained
+		void push(deque<edit> &edits, edit &&e) {
+			bytes += e.size();
+			edits.push_back(move(e));
+			// forget the oldest edits
+			while (undo_edits.size() > max_edits || (bytes > max_bytes && !undo_edits.empty())) {
+				bytes -= undo_edits.front().size();
+				release(undo_edits.front());
+				undo_edits.pop_front();
+			}
+		}
+
+		edit pop(deque<edit> &edits) {
+			edit e = move(edits.back());
+			edits.pop_back();
+			bytes -= e.size();
+			return e;
+		}
+
+		void clearRedo() {
+			for (auto &e : redo_edits) {
+				bytes -= e.size();
+				release(e);
+			}
+			redo_edits.clear();
+		}
+	};
+
+	void Graph::beginEdit() {
+		if (!journal) journal = make_shared<Journal>();
+		if (journal->depth++ == 0) {
+			journal->current.clear();
+			journal->merge.clear();
+			recording = true;
+		}
+	}
+
+	void Graph::endEdit() {
+		assert(journal && journal->depth > 0);
+		if (--journal->depth > 0) return;
+		recording = false;
+		journal->merge.clear();
+		if (journal->current.empty()) return;
+		journal->clearRedo();
+		journal->retain(journal->current);
+		journal->push(journal->undo_edits, move(journal->current));
+		journal->current = Journal::edit();
+	}
+
+	bool Graph::isEditing() const {
+		return journal && journal->depth > 0;
+	}
+
+	bool Graph::undo() {
+		if (!journal || journal->depth > 0 || journal->undo_edits.empty()) return false;
+		Journal::edit e = journal->pop(journal->undo_edits);
+		journal->apply(*this, e, false);
+		journal->push(journal->redo_edits, move(e));
+		return true;
+	}
+
+	bool Graph::redo() {
+		if (!journal || journal->depth > 0 || journal->redo_edits.empty()) return false;
+		Journal::edit e = journal->pop(journal->redo_edits);
+		journal->apply(*this, e, true);
+		journal->push(journal->undo_edits, move(e));
+		return true;
+	}
+
+	void Graph::clearHistory() {
+		if (!journal) return;
+		journal->undo_edits.clear();
+		journal->redo_edits.clear();
+		journal->recreated.clear();
+		journal->id_refs.clear();
+		journal->current.clear();
+		journal->merge.clear();
+		journal->bytes = 0;
+	}
+
+	size_t Graph::historySize() const {
+		return journal ? journal->bytes + journal->current.size() : 0;
+	}
+
+	void Graph::recordAddNode(Node *n) {
+		Journal::node_op op;
+		op.type = Journal::op_add_node;
+		op.n = Journal::ref(n);
+		op.s = Journal::state(n);
+		journal->append(op);
+	}
+
+	void Graph::recordDeleteNode(Node *n) {
+		Journal::node_op op;
+		op.type = Journal::op_delete_node;
+		op.n = Journal::ref(n);
+		op.s = Journal::state(n);
+		journal->append(op);
+	}
+
+	void Graph::recordAddEdge(Edge *e) {
+		Journal::edge_op op;
+		op.type = Journal::op_add_edge;
+		op.n1 = Journal::ref(e->node1);
+		op.n2 = Journal::ref(e->node2);
+		op.spring = e->spring;
+		journal->append(op);
+	}
+
+	void Graph::recordDeleteEdge(Edge *e) {
+		Journal::edge_op op;
+		op.type = Journal::op_delete_edge;
+		op.n1 = Journal::ref(e->node1);
+		op.n2 = Journal::ref(e->node2);
+		op.spring = e->spring;
+		journal->append(op);
+	}
+
+	void Graph::recordMove(Node *n, const float3 &d) {
+		Journal::move_op op;
+		op.type = Journal::op_move;
+		op.n = Journal::ref(n);
+		const float3 p = n->position + d;
+		op.x0 = n->position.x();
+		op.y0 = n->position.y();
+		op.x1 = p.x();
+		op.y1 = p.y();
+		size_t offset;
+		if (journal->mergeable(n, op.type, op, offset)) {
+			// one record per node per edit
+			Journal::move_op op0 = Journal::load<Journal::move_op>(journal->current, offset);
+			op0.x1 = op.x1;
+			op0.y1 = op.y1;
+			Journal::store(journal->current, offset, op0);
+		}
+	}
+
+	void Graph::recordFixed(Node *n, bool fixed) {
+		Journal::flag_op op;
+		op.type = Journal::op_fixed;
+		op.n = Journal::ref(n);
+		op.before = n->fixed;
+		op.after = fixed;
+		size_t offset;
+		if (journal->mergeable(n, op.type, op, offset)) {
+			Journal::flag_op op0 = Journal::load<Journal::flag_op>(journal->current, offset);
+			op0.after = fixed;
+			Journal::store(journal->current, offset, op0);
+		}
+	}
+
+	void Graph::recordSelect(Node *n, bool selected) {
+		Journal::flag_op op;
+		op.type = Journal::op_select;
+		op.n = Journal::ref(n);
+		op.before = n->selected;
+		op.after = selected;
+		size_t offset;
+		if (journal->mergeable(n, op.type, op, offset)) {
+			Journal::flag_op op0 = Journal::load<Journal::flag_op>(journal->current, offset);
+			op0.after = selected;
+			Journal::store(journal->current, offset, op0);
+		}
+	}
+
+	void Graph::recordElevation(Node *n, float elevation) {
+		Journal::elevation_op op;
+		op.type = Journal::op_elevation;
+		op.n = Journal::ref(n);
+		op.before = n->elevation;
+		op.after = elevation;
+		size_t offset;
+		if (journal->mergeable(n, op.type, op, offset)) {
+			Journal::elevation_op op0 = Journal::load<Journal::elevation_op>(journal->current, offset);
+			op0.after = elevation;
+			Journal::store(journal->current, offset, op0);
+		}
+	}
+
+}
@@ -1,8 +1,10 @@
 
-#include <unordered_set>
+#include <vector>
 #include <algorithm>
 #include <iterator>
 #include <cstring>
+#include <memory>
+#include <functional>
 
 #include "Graph.hpp"
 
@@ -16,7 +18,8 @@ namespace {
 	// http://www.cs.princeton.edu/courses/archive/fall03/cs126/assignments/barnes-hut.html
 	class bh_tree {
 	private:
-		using set_t = unordered_set<Graph::Node *>;
+		// ordered, so forces are always summed in the same order
+		using set_t = vector<Graph::Node *>;
 
 		static const int max_leaf_elements = 8;
 
@@ -63,7 +66,7 @@ namespace {
 			void dump(set_t &values) {
 				// move values out of this node
 				for (auto v : m_values) {
-					values.insert(v);
+					values.push_back(v);
 				}
 				// move values out of child nodes
 				for (bh_node **pn = m_children + 4; pn --> m_children; ) {
@@ -111,7 +114,8 @@ namespace {
 
 			bool insert(Graph::Node *n, bool reinsert = false) {
 				if (m_isleaf && m_count < max_leaf_elements) {
-					if (!m_values.insert(n).second) return false;
+					if (find(m_values.begin(), m_values.end(), n) != m_values.end()) return false;
+					m_values.push_back(n);
 				} else {
 					// not a leaf or should not be
 					unleafify();
@@ -133,6 +137,37 @@ namespace {
 				return true;
 			}
 
+			// remove an element that was inserted with position p and charge q
+			bool remove(Graph::Node *n, const float3 &p, float q) {
+				if (m_isleaf) {
+					auto it = find(m_values.begin(), m_values.end(), n);
+					if (it == m_values.end()) return false;
+					m_values.erase(it);
+				} else {
+					unsigned cid = childID(p);
+					bh_node *child = m_children[cid];
+					if (!child || !child->remove(n, p, q)) return false;
+					if (child->count() == 0) {
+						delete child;
+						m_children[cid] = nullptr;
+					}
+				}
+				m_count--;
+				// update charge and centre-of-charge
+				m_charge -= q;
+				if (m_count == 0 || m_charge <= 0) {
+					m_coc = m_bound.center();
+					m_charge = 0;
+				} else {
+					m_coc = (m_coc * (m_charge + q) - p * q) / m_charge;
+				}
+				if (m_count <= max_leaf_elements) {
+					// this should be a leaf again
+					leafify();
+				}
+				return true;
+			}
+
 			void put_child(bh_node *child) {
 				unsigned cid = childID(child->bound().center());
 				assert(!m_children[cid]);
@@ -275,7 +310,14 @@ namespace {
 			}
 		}
 
-		float3 force(Graph::Node *n0) {
+		// remove an element that was inserted with position p and charge q.
+		// returns false if the element could not be found.
+		bool remove(Graph::Node *n, const float3 &p, float q) {
+			if (!m_root) return false;
+			return m_root->remove(n, p, q);
+		}
+
+		float3 force(Graph::Node *n0) const {
 			if (!m_root) return float3(0);
 			return m_root->force(n0);
 		}
@@ -290,6 +332,7 @@ namespace {
 		if (m_isleaf) {
 			m_isleaf = false;
 			set_t temp = move(m_values);
+			m_values.clear();
 			for (auto n : temp) {
 				insert(n, true);
 			}
@@ -315,83 +358,477 @@ namespace {
 
 namespace skadi {
 
+	// tree of nodes that will not move (or otherwise change) during layout.
+	// kept between layout calls and updated incrementally.
+	class Graph::LayoutCache {
+	public:
+		bh_tree tree;
+
+		// set of active nodes during the last layout call, if owned by the graph.
+		// the nodes themselves are flagged with layout_active.
+		const vector<Node *> *active_src = nullptr;
+
+		// graph layout version the tree is up to date with
+		unsigned long long version = 0;
+
+		// elements in the tree, and incremental changes since it was last rebuilt
+		size_t count = 0;
+		size_t changes = 0;
+		bool valid = false;
+
+		void insert(Node *n) {
+			if (n->layout_static) return;
+			n->layout_static = true;
+			n->layout_position = n->position;
+			n->layout_charge = n->charge;
+			tree.insert(n);
+			count++;
+			changes++;
+		}
+
+		void remove(Node *n) {
+			if (!n->layout_static) return;
+			n->layout_static = false;
+			// removal relies on the position and charge at insertion
+			if (!tree.remove(n, n->layout_position, n->layout_charge)) valid = false;
+			count--;
+			changes++;
+		}
+	};
+
+	void Graph::updateLayoutCache(const std::vector<Node *> &active_nodes) {
+
+		if (!layout_cache) layout_cache = make_shared<LayoutCache>();
+		LayoutCache &c = *layout_cache;
+
+		// the graph only knows when its own sets change
+		const bool tracked = &active_nodes == &nodes || &active_nodes == &selected_nodes;
+		if (c.valid && tracked && c.active_src == &active_nodes && c.version == layout_version) return;
+
+		// membership of the new active set, by node index
+		vector<char> is_active(nodes.size(), 0);
+		for (auto n : active_nodes) {
+			is_active[n->index] = 1;
+		}
+
+		auto is_static = [&](Node *n) {
+			return n->fixed || !is_active[n->index];
+		};
+
+		auto update = [&](Node *n) {
+			if (is_static(n)) {
+				c.insert(n);
+			} else {
+				c.remove(n);
+			}
+		};
+
+		if (c.valid) {
+			// changed nodes need to be re-inserted
+			for (auto n : sortByID(layout_dirty)) {
+				c.remove(n);
+				update(n);
+			}
+			// nodes that became inactive
+			vector<Node *> inactive;
+			for (auto n : nodes) {
+				if (n->layout_active && !is_active[n->index]) inactive.push_back(n);
+			}
+			for (auto n : sortByID(inactive)) {
+				update(n);
+			}
+			// nodes that may have become active
+			for (auto n : sortByID(active_nodes)) {
+				update(n);
+			}
+		}
 
-	int Graph::doLayout(int steps, const std::unordered_set<Node *> &active_nodes) {
+		// removal doesnt rebalance the tree and accumulates error in the centres-of-charge,
+		// so rebuild from scratch occasionally (and if removal ever fails)
+		if (!c.valid || c.changes > max(c.count, size_t(1024))) {
+			// NOTE this is slow with VS debugger attached, even a release-mode build
+			c.tree = bh_tree();
+			c.count = 0;
+			for (auto n : sortByID(nodes)) {
+				n->layout_static = false;
+				if (is_static(n)) c.insert(n);
+			}
+			c.changes = 0;
+			c.valid = true;
+		}
 
-		// tree of nodes that will not move
-		bh_tree bht0;
-		
-		// build tree of nodes that wont move (or otherwise change)
-		// NOTE this is slow with VS debugger attached, even a release-mode build
+		for (auto n : layout_dirty) {
+			n->dirty_index = unsigned(-1);
+		}
+		layout_dirty.clear();
 		for (auto n : nodes) {
-			if (n->fixed || active_nodes.find(n) == active_nodes.end()) {
-				// node fixed or not active
-				bht0.insert(n);
+			n->layout_active = is_active[n->index];
+		}
+		c.active_src = &active_nodes;
+		c.version = layout_version;
+	}
+
+	void Graph::forgetLayoutNode(Node *n) {
+		if (listContains(layout_dirty, n, &Node::dirty_index)) listErase(layout_dirty, n, &Node::dirty_index);
+		layout_version++;
+		n->layout_active = false;
+		if (layout_cache) layout_cache->remove(n);
+	}
+
+	// net force acting on a moving node
+	static float3 layoutForce(const bh_tree &bht0, const bh_tree &bht, Graph::Node *n0) {
+
+		// acting force
+		float3 f;
+
+		// charge repulsion from every node
+		f += bht0.force(n0);
+		f += bht.force(n0);
+
+		// spring contraction from connected nodes
+		for (auto e : n0->getEdges()) {
+			// other node
+			Graph::Node *n1 = e->other(n0);
+			// direction is towards other node
+			float3 v = n1->position - n0->position;
+			f += e->spring * v; // spring constant
+		}
+
+		// drag force
+		//f -= n0->velocity * n0->velocity.mag() * 1000.f;
+
+		return f;
+	}
+
+	// sum in a fixed order, so results dont depend on thread count
+	static float ordered_sum(const vector<float> &v) {
+		float r = 0.f;
+		for (float x : v) r += x;
+		return r;
+	}
+
+	bool Graph::stepEuler(const vector<Node *> &nodes0, const vector<float3> &forces) {
+
+		// nothing to move (and no average speed)
+		if (nodes0.empty()) return true;
+		const int n_nodes = int(nodes0.size());
+
+		vector<float> speeds(nodes0.size());
+
+		// accelerations, velocities; get average speed
+#pragma omp parallel for
+		for (int i = 0; i < n_nodes; i++) {
+			Node *n0 = nodes0[i];
+
+			// acceleration
+			float3 a = forces[i] / n0->mass;
+
+			// velocity
+			n0->velocity += a * timestep;
+
+			// damping
+			n0->velocity *= 0.98;
+
+			speeds[i] = n0->velocity.mag();
+		}
+
+		// update positions
+#pragma omp parallel for
+		for (int i = 0; i < n_nodes; i++) {
+			Node *n0 = nodes0[i];
+			n0->position += n0->velocity * timestep;
+		}
+
+		// TODO tune threshold
+		return timestep * ordered_sum(speeds) / nodes0.size() < 0.0001f;
+	}
+
+	// FIRE: fast inertial relaxation engine
+	// Bitzek et al. 2006, Structural Relaxation Made Simple
+	bool Graph::stepFIRE(const vector<Node *> &nodes0, const vector<float3> &forces) {
+
+		// nothing to move (and no average displacement)
+		if (nodes0.empty()) return true;
+		const int n_nodes = int(nodes0.size());
+
+		static const int n_min = 5;
+		static const float f_inc = 1.1f;
+		static const float f_dec = 0.5f;
+		static const float alpha_start = 0.1f;
+		static const float f_alpha = 0.99f;
+		// upper limit on timestep; stability is maintained by backing off when power goes negative
+		const float dt_max = 10.f * timestep;
+		const float dt_min = 0.01f * timestep;
+		// furthest a node may move in one step
+		static const float max_step = 0.005f;
+
+		// per-node quantities to sum
+		vector<float> temp(nodes0.size());
+
+		// power: is the system still going downhill?
+#pragma omp parallel for
+		for (int i = 0; i < n_nodes; i++) {
+			temp[i] = float3::dot(forces[i], nodes0[i]->velocity);
+		}
+		const float power = ordered_sum(temp);
+
+		if (power > 0.f) {
+			// steer velocities towards the force direction
+			const float alpha = fire.alpha;
+#pragma omp parallel for
+			for (int i = 0; i < n_nodes; i++) {
+				Node *n0 = nodes0[i];
+				const float3 &f = forces[i];
+				float f2 = float3::dot(f, f);
+				if (f2 > 0.f) {
+					n0->velocity = (1.f - alpha) * n0->velocity + alpha * n0->velocity.mag() * f / sqrt(f2);
+				}
+			}
+			if (++fire.count > n_min) {
+				fire.dt = min(fire.dt * f_inc, dt_max);
+				fire.alpha *= f_alpha;
 			}
+		} else {
+			// overshot; stop and take smaller steps
+			fire.count = 0;
+			fire.dt = max(fire.dt * f_dec, dt_min);
+			fire.alpha = alpha_start;
+#pragma omp parallel for
+			for (int i = 0; i < n_nodes; i++) {
+				nodes0[i]->velocity = float3(0);
+			}
+		}
+
+		// integrate (semi-implicit euler) with per-node step limit
+		const float dt = fire.dt;
+#pragma omp parallel for
+		for (int i = 0; i < n_nodes; i++) {
+			Node *n0 = nodes0[i];
+			n0->velocity += forces[i] / n0->mass * dt;
+			float3 d = n0->velocity * dt;
+			float dm = d.mag();
+			if (dm > max_step) {
+				d *= max_step / dm;
+				n0->velocity = d / dt;
+				dm = max_step;
+			}
+			n0->position += d;
+			temp[i] = dm;
 		}
+		const float disp_sum = ordered_sum(temp);
+
+		// converged when average displacement stays small for a few steps.
+		// displacement is always small right after a restart, so those steps dont count.
+		if (fire.count > n_min && disp_sum / nodes0.size() < 0.0001f) {
+			fire.still++;
+		} else {
+			fire.still = 0;
+		}
+		return fire.still >= n_min;
+	}
 
-		// nodes that will be moved
-		vector<Node *> nodes0;
-		copy_if(active_nodes.begin(), active_nodes.end(), back_inserter(nodes0), [](Node *n) { return !n->fixed; });
+	int Graph::doLayout(int steps, const std::vector<Node *> &active_nodes) {
+
+		// tree of nodes that wont move (or otherwise change)
+		updateLayoutCache(active_nodes);
+		const bh_tree &bht0 = layout_cache->tree;
+
+		// nodes that will be moved, in a stable order
+		vector<Node *> nodes0 = sortByID(active_nodes);
+		nodes0.erase(remove_if(nodes0.begin(), nodes0.end(), [](Node *n) { return n->fixed; }), nodes0.end());
+
+		// nothing to move, so already converged
+		if (nodes0.empty()) return 0;
+		const int n_nodes = int(nodes0.size());
+
+		// forces acting on moving nodes
+		vector<float3> forces(nodes0.size());
+
+		// where things were before moving
+		Region moved = nodeRegion(nodes0);
 
 		// run steps
-		for (int step = 0; step < steps; step++) {
-			
-			float speed_sum = 0.f;
+		int step = 0;
+		while (step < steps) {
 
-			// add moving nodes to new tree
-			bh_tree bht(bht0);
+			// tree of moving nodes only, so each step scales with the number of active nodes
+			bh_tree bht;
 			for (auto n : nodes0) {
 				bht.insert(n);
 			}
 
-			// calculate forces, accelerations, velocities; get average speed
-#pragma omp parallel for reduction(+:speed_sum)
-			for (int i = 0; i < nodes0.size(); i++) {
-				Node *n0 = nodes0[i];
+			// calculate forces
+#pragma omp parallel for
+			for (int i = 0; i < n_nodes; i++) {
+				forces[i] = layoutForce(bht0, bht, nodes0[i]);
+			}
+
+			// accelerations, velocities, positions
+			bool converged = integrator == Integrator::fire ? stepFIRE(nodes0, forces) : stepEuler(nodes0, forces);
+
+			step++;
+			if (converged) break;
+		}
+
+		// moved nodes may have changed cells
+		if (grid_cell > 0.f) {
+			for (auto n : nodes0) {
+				gridUpdate(n);
+			}
+		}
+
+		if (step > 0 && !nodes0.empty()) {
+			moved.add(nodeRegion(nodes0));
+			markChanged(moved);
+		}
 
-				// acting force
-				float3 f;
+		return step;
+	}
+
+
+	namespace {
+
+		// one level of a multilevel layout hierarchy
+		struct ml_level {
+			// coarse graph
+			unique_ptr<Graph> graph;
+			// finer node index -> coarse node
+			vector<Graph::Node *> parent;
+			// coarse node index -> position before layout
+			vector<float3> origin;
+		};
 
-				// charge repulsion from every node
-				f += bht.force(n0);
+		// collapse a maximal matching of edges into single nodes.
+		// static nodes are only matched with other static nodes, and stay static.
+		ml_level coarsen(const Graph &g, const function<bool(Graph::Node *)> &is_static, Graph::Integrator integrator) {
+			ml_level l;
+			l.graph.reset(new Graph());
+			l.graph->setIntegrator(integrator);
 
-				// spring contraction from connected nodes
+			const vector<Graph::Node *> nodes0 = Graph::sortByID(g.getNodes());
+			l.parent.assign(nodes0.size(), nullptr);
+
+			for (auto n0 : nodes0) {
+				if (l.parent[n0->getIndex()]) continue;
+				const bool s0 = is_static(n0);
+
+				// match with the lightest unmatched neighbour, to keep coarse nodes balanced
+				Graph::Node *n1 = nullptr;
 				for (auto e : n0->getEdges()) {
-					// other node
-					Node *n1 = e->other(n0);
-					// direction is towards other node
-					float3 v = n1->position - n0->position;
-					f += e->spring * v; // spring constant
+					Graph::Node *n = e->other(n0);
+					if (l.parent[n->getIndex()] || is_static(n) != s0) continue;
+					if (!n1 || n->mass < n1->mass) n1 = n;
 				}
 
-				// drag force
-				//f -= n0->velocity * n0->velocity.mag() * 1000.f;
-
-				// acceleration
-				float3 a = f / n0->mass;
+				// coarse node at centre-of-charge, with combined mass and charge
+				float q = n0->charge;
+				float m = n0->mass;
+				float3 p = n0->position * n0->charge;
+				if (n1) {
+					q += n1->charge;
+					m += n1->mass;
+					p += n1->position * n1->charge;
+				}
+				p = q > 0.f ? p / q : n0->position;
 
-				// velocity
-				n0->velocity += a * timestep;
+				Graph::Node *c = l.graph->addNode(p);
+				c->mass = m;
+				c->charge = q;
+				l.graph->setFixed(c, s0);
 
-				// damping
-				n0->velocity *= 0.98;
+				l.parent[n0->getIndex()] = c;
+				if (n1) l.parent[n1->getIndex()] = c;
+				l.origin.push_back(c->position);
+			}
 
-				speed_sum += n0->velocity.mag();
+			// edges between coarse nodes; parallel springs combine
+			for (auto n0 : nodes0) {
+				for (auto e : n0->getEdges()) {
+					// visit each edge once
+					if (e->node1 != n0) continue;
+					Graph::Node *c1 = l.parent[e->node1->getIndex()];
+					Graph::Node *c2 = l.parent[e->node2->getIndex()];
+					if (c1 == c2) continue;
+					Graph::Edge *ce = c1->findEdge(c2);
+					if (ce) {
+						ce->spring += e->spring;
+					} else {
+						l.graph->addEdge(c1, c2)->spring = e->spring;
+					}
+				}
 			}
 
-			// update positions
-#pragma omp parallel for
-			for (int i = 0; i < nodes0.size(); i++) {
-				Node *n0 = nodes0[i];
-				n0->position += n0->velocity * timestep;
+			return l;
+		}
+
+	}
+
+	int Graph::doMultilevelLayout(int steps, const std::vector<Node *> &active_nodes) {
+
+		// stop coarsening at this many moving nodes
+		static const size_t coarse_size = 64;
+		static const size_t max_levels = 24;
+		// layout steps for levels other than the coarsest
+		static const int smooth_steps = 30;
+
+		// where things were before moving
+		Region moved = nodeRegion(active_nodes);
+
+		// membership of the active set, by node index
+		vector<char> is_active(nodes.size(), 0);
+		for (auto n : active_nodes) {
+			is_active[n->index] = 1;
+		}
+
+		auto is_static0 = [&](Node *n) {
+			return n->fixed || !is_active[n->index];
+		};
+
+		auto is_static1 = [](Node *n) {
+			return n->fixed;
+		};
+
+		auto count_moving = [](const Graph &g, const function<bool(Node *)> &is_static) {
+			return size_t(count_if(g.nodes.begin(), g.nodes.end(), [&](Node *n) { return !is_static(n); }));
+		};
+
+		// build hierarchy, finest first
+		vector<ml_level> levels;
+		const Graph *g = this;
+		size_t moving = count_moving(*this, is_static0);
+		while (moving > coarse_size && levels.size() < max_levels) {
+			ml_level l = coarsen(*g, levels.empty() ? function<bool(Node *)>(is_static0) : is_static1, integrator);
+			// give up if matching isnt reducing the graph much
+			if (l.graph->nodes.size() > g->nodes.size() * 9 / 10) break;
+			levels.push_back(move(l));
+			g = levels.back().graph.get();
+			moving = count_moving(*g, is_static1);
+		}
+
+		// lay out each level coarsest first, then move finer nodes with their coarse node
+		int total = 0;
+		for (size_t i = levels.size(); i --> 0; ) {
+			ml_level &l = levels[i];
+			// finer levels start close to converged, so only smooth them
+			total += l.graph->doLayout(i + 1 == levels.size() ? steps : min(steps, smooth_steps), l.graph->nodes);
+			const Graph &g1 = i == 0 ? *this : *levels[i - 1].graph;
+			for (auto n : g1.nodes) {
+				if (i == 0 ? is_static0(n) : is_static1(n)) continue;
+				Node *c = l.parent[n->index];
+				n->position += c->position - l.origin[c->index];
+				n->velocity = float3(0);
 			}
+		}
 
-			// TODO tune threshold
-			if (timestep * speed_sum / nodes0.size() < 0.0001f) return step + 1;
+		// prolongation moved nodes without marking them
+		if (!levels.empty()) {
+			moved.add(nodeRegion(active_nodes));
+			markChanged(moved);
 		}
 
-		return steps;
+		// refine the actual graph
+		total += doLayout(steps, active_nodes);
+		return total;
 	}
 
 
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace skadi {
+
+	// Allocates fixed-size blocks from large chunks, reusing freed blocks.
+	// Memory is only returned when the pool is destroyed, a chunk at a time, so
+	// destroying a pool of many blocks is cheap. Destructors are not run; anything
+	// allocated here that still needs destruction must be destroyed beforehand.
+	//
+	// Optionally, each block has a generation that changes whenever it is freed. It is kept
+	// in front of the block rather than in it, so generation() can be asked of a block that
+	// has since been freed (and maybe reused) to tell whether a kept pointer is still good.
+	class BlockPool {
+	private:
+		static const size_t align = 16;
+		static const size_t min_chunk_size = 4096;
+		static const size_t max_chunk_size = 1 << 20;
+
+		struct free_block {
+			free_block *next;
+		};
+
+		size_t m_block_size;
+		// generation header in front of each block, if any; blocks are m_header + m_block_size apart
+		size_t m_header;
+		size_t m_chunk_blocks;
+		std::vector<std::unique_ptr<char[]>> m_chunks;
+
+		// unused space at the end of the last chunk
+		char *m_next = nullptr;
+		size_t m_remaining = 0;
+
+		free_block *m_free = nullptr;
+		size_t m_count = 0;
+
+		uint64_t * generationOf(const void *p) const {
+			assert(m_header);
+			return reinterpret_cast<uint64_t *>(const_cast<char *>(static_cast<const char *>(p)) - m_header);
+		}
+
+	public:
+		explicit BlockPool(size_t block_size, bool generations = false) {
+			// keep every block aligned for sse members
+			m_block_size = std::max(block_size, sizeof(free_block));
+			m_block_size = (m_block_size + align - 1) / align * align;
+			m_header = generations ? align : 0;
+			m_chunk_blocks = std::max(min_chunk_size / (m_header + m_block_size), size_t(1));
+		}
+
+		BlockPool(const BlockPool &) = delete;
+		BlockPool & operator=(const BlockPool &) = delete;
+
+		BlockPool(BlockPool &&) = default;
+		BlockPool & operator=(BlockPool &&) = default;
+
+		void * allocate() {
+			m_count++;
+			if (m_free) {
+				void *p = m_free;
+				m_free = m_free->next;
+				return p;
+			}
+			if (!m_remaining) {
+				// chunks grow, so the number of chunks stays small
+				m_chunks.emplace_back(new char[m_chunk_blocks * (m_header + m_block_size) + align]);
+				uintptr_t a = uintptr_t(m_chunks.back().get());
+				m_next = reinterpret_cast<char *>((a + align - 1) / align * align);
+				m_remaining = m_chunk_blocks;
+				if (m_chunk_blocks * (m_header + m_block_size) < max_chunk_size) m_chunk_blocks *= 2;
+			}
+			if (m_header) new (m_next) uint64_t(0);
+			void *p = m_next + m_header;
+			m_next += m_header + m_block_size;
+			m_remaining--;
+			return p;
+		}
+
+		void deallocate(void *p) {
+			assert(m_count > 0);
+			m_count--;
+			if (m_header) (*generationOf(p))++;
+			free_block *b = reinterpret_cast<free_block *>(p);
+			b->next = m_free;
+			m_free = b;
+		}
+
+		size_t blockSize() const {
+			return m_block_size;
+		}
+
+		// times a block has been freed; only for pools made with generations.
+		// p must have come from this pool, but may have been freed since.
+		uint64_t generation(const void *p) const {
+			return *generationOf(p);
+		}
+
+		// blocks currently allocated
+		size_t count() const {
+			return m_count;
+		}
+	};
+
+}
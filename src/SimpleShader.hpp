@@ -2,11 +2,14 @@
 #ifndef SKADI_SIMPLE_SHADER_HPP
 #define SKADI_SIMPLE_SHADER_HPP
 
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 #include <sstream>
 
 #include "GL.hpp"
+#include "Initial3D.hpp"
 #include "Log.hpp"
 
 namespace skadi {
@@ -116,6 +119,111 @@ namespace skadi {
 		return prog;
 	}
 
+	// uniform values, by component type and count
+	inline void setUniform(GLint loc, bool x) { glUniform1i(loc, x); }
+	inline void setUniform(GLint loc, GLint x) { glUniform1i(loc, x); }
+	inline void setUniform(GLint loc, GLint x, GLint y) { glUniform2i(loc, x, y); }
+	inline void setUniform(GLint loc, GLfloat x) { glUniform1f(loc, x); }
+	inline void setUniform(GLint loc, GLfloat x, GLfloat y) { glUniform2f(loc, x, y); }
+	inline void setUniform(GLint loc, GLfloat x, GLfloat y, GLfloat z) { glUniform3f(loc, x, y, z); }
+	inline void setUniform(GLint loc, const initial3d::mat4f &m) { glUniformMatrix4fv(loc, 1, true, m); }
+
+	// Location of a uniform of N components of type T, looked up once.
+	// set() applies to the program in use, as with glUniform*().
+	template <typename T, int N = 1>
+	class uniform {
+	private:
+		GLint m_loc = -1;
+
+	public:
+		uniform() { }
+
+		uniform(GLuint prog, const char *name) : m_loc(glGetUniformLocation(prog, name)) { }
+
+		GLint location() const {
+			return m_loc;
+		}
+
+		template <typename ...ArgTs>
+		void set(const ArgTs &...args) const {
+			static_assert(sizeof...(ArgTs) == N, "wrong number of uniform components");
+			setUniform(m_loc, T(args)...);
+		}
+	};
+
+	// A program from makeShaderProgram(), with its uniforms looked up once when it is made.
+	//
+	// UniformsT is a struct of uniform<> members, constructed from the program name:
+	//
+	//   struct box_uniforms {
+	//     uniform<initial3d::mat4f> projectionMatrix;
+	//     explicit box_uniforms(GLuint prog) : projectionMatrix(prog, "projectionMatrix") { }
+	//   };
+	//
+	// Samplers are given their texture units when the program is made, so drawing only binds textures.
+	// The program belongs to the context that was current then, and is deleted with this.
+	template <typename UniformsT>
+	class shader_program {
+	private:
+		GLuint m_prog = 0;
+		std::unique_ptr<UniformsT> m_uniforms;
+
+	public:
+		shader_program() { }
+
+		shader_program(
+			const std::string &profile, const std::vector<GLenum> &stypes, const std::string &source,
+			const std::vector<std::pair<const char *, GLint>> &samplers = { }
+		) {
+			m_prog = makeShaderProgram(profile, stypes, source);
+			m_uniforms.reset(new UniformsT(m_prog));
+			if (!samplers.empty()) {
+				GLint prev = 0;
+				glGetIntegerv(GL_CURRENT_PROGRAM, &prev);
+				glUseProgram(m_prog);
+				for (const auto &s : samplers) {
+					glUniform1i(glGetUniformLocation(m_prog, s.first), s.second);
+				}
+				glUseProgram(prev);
+			}
+		}
+
+		shader_program(const shader_program &) = delete;
+		shader_program & operator=(const shader_program &) = delete;
+
+		shader_program(shader_program &&other) : m_prog(other.m_prog), m_uniforms(std::move(other.m_uniforms)) {
+			other.m_prog = 0;
+		}
+
+		shader_program & operator=(shader_program &&other) {
+			std::swap(m_prog, other.m_prog);
+			std::swap(m_uniforms, other.m_uniforms);
+			return *this;
+		}
+
+		~shader_program() {
+			if (m_prog) glDeleteProgram(m_prog);
+		}
+
+		GLuint id() const {
+			return m_prog;
+		}
+
+		explicit operator bool() const {
+			return m_prog;
+		}
+
+		// make this the program in use, and get its uniforms
+		const UniformsT & use() const {
+			glUseProgram(m_prog);
+			return *m_uniforms;
+		}
+
+		const UniformsT & uniforms() const {
+			return *m_uniforms;
+		}
+	};
+
 }
 
 #endif
@@ -7,20 +7,38 @@ editor controls, probably:
 - R: clear selection
 - DEL: delete selection
 - L: toggle layout on selection or everything
+- M: multilevel layout on selection or everything (one-off)
+- I: switch layout integrator (FIRE / Euler)
 - K: toggle automatic graph subdivision and branching (not implemented yet)
 - H: make heightmap
+- CTRL+Z / CTRL+Y (or CTRL+SHIFT+Z): undo / redo
+- F5 / F9: save / load graph (graph.skadi)
 
 global:
 - TAB: switch views
 - F1: toggle graph texture on mesh
+- F2: switch terrain mesh (full mesh / instanced patches / CDLOD / tessellated)
+- F3: switch terrain patch indices (triangles / strips)
+- F4: benchmark terrain meshes (frame times go to the log)
+- F6: switch terrain height storage (R32F / R16F / R16)
+- F7: switch terrain normal storage (RGBA16F / RG16F / RG8_SNORM)
+
+command line:
+- --benchmark [frames]: no visible window or editor; fly a fixed path over a perlin heightmap
+  with each terrain mesh, drawing offscreen, then log frame times and exit (default 300 frames).
+  glfw still needs a display, so run under something like xvfb-run where there isnt one.
 
 */
 
 
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <string>
 #include <vector>
 #include <stdexcept>
 #include <thread>
@@ -32,6 +50,7 @@ global:
 #include "Heightmap.hpp"
 #include "Graph.hpp"
 #include "GraphEditor.hpp"
+#include "Perlin.hpp"
 #include "RidgeConverter.hpp"
 #include "Window.hpp"
 #include "SimpleShader.hpp"
@@ -115,6 +134,192 @@ void display(int w, int h, bool textured = false) {
 
 }
 
+// draw the terrain view with each mesh variant in turn, and log the average frame time of each
+void benchmarkTerrain(int w, int h, bool textured) {
+	const int frames = 60;
+
+	struct variant {
+		Heightmap::Mode mode;
+		Heightmap::Indices indices;
+	};
+
+	const variant variants[] {
+		{ Heightmap::Mode::mesh, Heightmap::Indices::triangles },
+		{ Heightmap::Mode::instanced, Heightmap::Indices::triangles },
+		{ Heightmap::Mode::instanced, Heightmap::Indices::strips },
+		{ Heightmap::Mode::cdlod, Heightmap::Indices::triangles },
+		{ Heightmap::Mode::cdlod, Heightmap::Indices::strips },
+		{ Heightmap::Mode::tessellated, Heightmap::Indices::triangles }
+	};
+
+	const Heightmap::Mode mode0 = heightmap->getMode();
+	const Heightmap::Indices indices0 = heightmap->getIndices();
+
+	for (const variant &v : variants) {
+		heightmap->setMode(v.mode);
+		heightmap->setIndices(v.indices);
+
+		// not timed; builds anything made on first use
+		display(w, h, textured);
+
+		// display() finishes each frame
+		double t0 = glfwGetTime();
+		for (int i = 0; i < frames; i++) {
+			display(w, h, textured);
+		}
+		double ms = (glfwGetTime() - t0) * 1000.0 / frames;
+
+		// the full mesh always uses 32-bit triangle lists; tessellated has no indices
+		const char *indices = v.mode == Heightmap::Mode::mesh ? "32-bit triangles" : v.mode == Heightmap::Mode::tessellated ? "patches" : Heightmap::indicesName(v.indices);
+		gecom::log("Terrain") << Heightmap::modeName(v.mode) << " (" << indices << "): " << ms << "ms/frame, " << heightmap->getTriangleCount() << " triangles";
+	}
+
+	heightmap->setMode(mode0);
+	heightmap->setIndices(indices0);
+}
+
+// heights for the headless benchmark: a few octaves of perlin noise, roughly [0, 0.5]
+std::vector<float> perlinHeights(int size) {
+	Perlin perlin;
+	std::vector<float> heights(size_t(size) * size);
+#pragma omp parallel for
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			heights[size_t(size) * y + x] = float(0.25 + 0.5 * perlin.getNoise(double(x) / size, 0.37, double(y) / size, 5));
+		}
+	}
+	return heights;
+}
+
+// of sorted values, the one p of the way up
+double percentile(const std::vector<double> &sorted, double p) {
+	return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+// fly a fixed path over a perlin heightmap with each mesh mode, drawing offscreen, and log
+// frame time percentiles, cpu time in draw(), gpu time (timer queries) and triangle throughput.
+// throughput is over whole frames, as some drivers (llvmpipe) barely time the draw on the 'gpu'.
+int benchmarkHeadless(int frames) {
+	const int w = 1024, h = 768;
+	const int size = 1024;
+	const int warmup = 10;
+
+	// offscreen target, so the hidden window's framebuffer doesnt matter
+	GLuint fbo, rbo[2];
+	glGenFramebuffers(1, &fbo);
+	glGenRenderbuffers(2, rbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, rbo[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+	glBindRenderbuffer(GL_RENDERBUFFER, rbo[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbo[1]);
+	const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (!complete) {
+		gecom::log("Benchmark").error() << "Offscreen framebuffer incomplete";
+		return 1;
+	}
+
+	std::vector<float> heights = perlinHeights(size + 1);
+	Heightmap terrain(size, size);
+	terrain.setScale(vec3d(5, 5, 5));
+	terrain.setHeights(heights.data(), size + 1, size + 1);
+
+	Projection proj;
+	proj.setPerspectiveProjection(math::pi() / 3, double(w) / h, 0.1, 20000.0);
+	FPSCamera cam(win, vec3d::zero());
+
+	// world height of the terrain at world x, z
+	auto ground = [&](double x, double z) {
+		int tx = math::clamp(int((x / 10 + 0.5) * size + 0.5), 0, size);
+		int tz = math::clamp(int((z / 10 + 0.5) * size + 0.5), 0, size);
+		return 5.0 * heights[size_t(size + 1) * tz + tx];
+	};
+
+	// a loop around the middle, swinging in and out and up and down, looking ahead and a little down
+	auto pose = [&](int frame) {
+		double a = 2 * math::pi() * frame / frames;
+		double r = 3 + 1.5 * std::sin(3 * a);
+		double dr = 4.5 * std::cos(3 * a);
+		double x = r * std::cos(a), z = r * std::sin(a);
+		double dx = dr * std::cos(a) - r * std::sin(a), dz = dr * std::sin(a) + r * std::cos(a);
+		double y = ground(x, z) + 0.5 + 0.4 * (1 + std::sin(2 * a));
+		cam.setPose(vec3d(x, y, z), std::atan2(-dx, -dz), -0.2);
+	};
+
+	GLuint query;
+	glGenQueries(1, &query);
+
+	glClearColor(1.f, 1.f, 1.f, 1.f);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LESS);
+
+	gecom::log("Benchmark") << size << "x" << size << " perlin heightmap, " << w << "x" << h << ", " << frames << " frames";
+
+	const Heightmap::Mode modes[] { Heightmap::Mode::mesh, Heightmap::Mode::instanced, Heightmap::Mode::cdlod, Heightmap::Mode::tessellated };
+
+	for (Heightmap::Mode mode : modes) {
+		if (mode == Heightmap::Mode::tessellated && !Heightmap::tessellationSupported()) {
+			gecom::log("Benchmark").warning() << "Tessellation shaders not supported, skipping " << Heightmap::modeName(mode);
+			continue;
+		}
+		terrain.setMode(mode);
+
+		std::vector<double> frame_ms, draw_ms, gpu_ms;
+		size_t triangles = 0;
+
+		// the first frames arent timed; they build anything made on first use
+		for (int i = -warmup; i < frames; i++) {
+			pose(std::max(i, 0));
+
+			double t0 = glfwGetTime();
+			// the heightmap's normal pass binds its own framebuffer
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+			glViewport(0, 0, w, h);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glBeginQuery(GL_TIME_ELAPSED, query);
+			double d0 = glfwGetTime();
+			terrain.draw(cam.getViewTransform(), proj.getProjectionTransform());
+			double d1 = glfwGetTime();
+			glEndQuery(GL_TIME_ELAPSED);
+			glFinish();
+			double t1 = glfwGetTime();
+
+			// finished, so this doesnt wait
+			GLuint64 gpu_ns = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpu_ns);
+
+			if (i < 0) continue;
+			frame_ms.push_back((t1 - t0) * 1000.0);
+			draw_ms.push_back((d1 - d0) * 1000.0);
+			gpu_ms.push_back(gpu_ns * 1e-6);
+			triangles += terrain.getTriangleCount();
+		}
+
+		std::sort(frame_ms.begin(), frame_ms.end());
+		double frame_total = 0, draw_total = 0, gpu_total = 0;
+		for (double t : frame_ms) frame_total += t;
+		for (double t : draw_ms) draw_total += t;
+		for (double t : gpu_ms) gpu_total += t;
+
+		gecom::log("Benchmark") << std::fixed << std::setprecision(2) << Heightmap::modeName(mode)
+			<< ": frame p50 " << percentile(frame_ms, 0.5) << "ms, p90 " << percentile(frame_ms, 0.9)
+			<< "ms, p99 " << percentile(frame_ms, 0.99) << "ms, max " << frame_ms.back()
+			<< "ms; draw() " << draw_total / frames << "ms cpu, " << gpu_total / frames << "ms gpu; "
+			<< triangles / frames << " triangles/frame, " << triangles / (frame_total * 1000.0) << "M triangles/s";
+	}
+
+	glDeleteQueries(1, &query);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteRenderbuffers(2, rbo);
+
+	return 0;
+}
+
 void displayEditor(int w, int h) {
 	graphEditor->update();
 
@@ -136,7 +341,7 @@ void displayEditor(int w, int h) {
 
 
 
-int main() {
+int main(int argc, char *argv[]) {
 
 	std::cout << std::boolalpha;
 
@@ -147,6 +352,17 @@ int main() {
 		gecom::log("OMP") << "Default thread count: " << tc;
 	}
 
+	if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+		const int frames = argc > 2 ? std::max(std::atoi(argv[2]), 1) : 300;
+		// nothing is shown and it draws offscreen, so no multisampling or real size
+		win = gecom::createWindow().size(64, 64).title("Skadi").visible(false);
+		win->makeContextCurrent();
+		int r = benchmarkHeadless(frames);
+		delete win;
+		glfwTerminate();
+		return r;
+	}
+
 	const int size = 512;
 
 	// randomly placed note about texture parameters and debug messages:
@@ -156,8 +372,12 @@ int main() {
 	win = gecom::createWindow().size(1024, 768).hint(GLFW_SAMPLES, 16).title("Skadi").visible(true);
 	win->makeContextCurrent();
 
+	// background threads, for heightmap uploads
+	gecom::AsyncExecutor::start();
+
 	bool editor_enabled = true;
 	bool textured_mesh = true;
+	bool benchmark = false;
 
 	win->onKeyPress.subscribe([&](const gecom::key_event &e) {
 		if (e.key == GLFW_KEY_TAB) {
@@ -170,6 +390,37 @@ int main() {
 			textured_mesh = !textured_mesh;
 		}
 
+		if (e.key == GLFW_KEY_F2) {
+			auto mode = Heightmap::Mode((int(heightmap->getMode()) + 1) % 4);
+			heightmap->setMode(mode);
+			gecom::log("Terrain") << "Mesh: " << Heightmap::modeName(mode);
+			if (mode == Heightmap::Mode::tessellated && !Heightmap::tessellationSupported()) {
+				gecom::log("Terrain").warning() << "Tessellation shaders not supported, drawing CDLOD";
+			}
+		}
+
+		if (e.key == GLFW_KEY_F3) {
+			auto indices = heightmap->getIndices() == Heightmap::Indices::strips ? Heightmap::Indices::triangles : Heightmap::Indices::strips;
+			heightmap->setIndices(indices);
+			gecom::log("Terrain") << "Patch indices: " << Heightmap::indicesName(indices);
+		}
+
+		if (e.key == GLFW_KEY_F4 && !editor_enabled) {
+			benchmark = true;
+		}
+
+		if (e.key == GLFW_KEY_F6) {
+			auto format = Heightmap::HeightFormat((int(heightmap->getHeightFormat()) + 1) % 3);
+			heightmap->setHeightFormat(format);
+			gecom::log("Terrain") << "Height storage: " << Heightmap::heightFormatName(format) << ", " << (heightmap->getTextureBytes() >> 10) << "KiB of textures";
+		}
+
+		if (e.key == GLFW_KEY_F7) {
+			auto format = Heightmap::NormalFormat((int(heightmap->getNormalFormat()) + 1) % 3);
+			heightmap->setNormalFormat(format);
+			gecom::log("Terrain") << "Normal storage: " << Heightmap::normalFormatName(format) << ", " << (heightmap->getTextureBytes() >> 10) << "KiB of textures";
+		}
+
 		return false;
 	}).forever();
 
@@ -184,6 +435,9 @@ int main() {
 	while (!win->shouldClose()) {
 		glfwPollEvents();
 
+		// install any heightmap streamed in since the last frame
+		heightmap->pollUploads();
+
 		double now = glfwGetTime();
 		auto size = win->size();
 		glViewport(0, 0, size.w, size.h);
@@ -193,6 +447,9 @@ int main() {
 			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 			if (editor_enabled) {
 				displayEditor(size.w, size.h);
+			} else if (benchmark) {
+				benchmarkTerrain(size.w, size.h, textured_mesh);
+				benchmark = false;
 			} else {
 				display(size.w, size.h, textured_mesh);
 			}
@@ -206,7 +463,7 @@ int main() {
 			sprintf(
 				fpsString, "Skadi [%d FPS @%dx%d] [%d/%d Nodes, %d SPS]",
 				fps, win->width(), win->height(), graphEditor->getActiveNodeCount(),
-				graphEditor->getGraph()->getNodes().size(), graphEditor->pollStepCount()
+				graphEditor->getNodeCount(), graphEditor->pollStepCount()
 			);
 			win->title(fpsString);
 			fps = 0;
@@ -215,6 +472,11 @@ int main() {
 		fps++;
 	}
 
+	// stops the layout thread
+	delete graphEditor;
+
+	gecom::AsyncExecutor::stop();
+
 	delete win;
 
 	glfwTerminate();